@@ -1,5 +1,14 @@
 #include "blob.h"
 
+#ifdef HAVE_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "blob_pool.h"
+#include "global.h"
 #include "log.h"
 #include "relay_threads.h"
 #include "timer.h"
@@ -28,53 +37,218 @@ void *calloc_or_fatal(size_t size)
     return ptr;
 }
 
+/* the blobs and the queue chunks come from the blob pool if it is enabled */
+static inline void *blob_alloc(size_t size)
+{
+    return blob_pool_enabled()? blob_pool_alloc(size) : malloc_or_fatal(size);
+}
+
+static inline void blob_free(void *p)
+{
+    if (blob_pool_enabled())
+        blob_pool_free(p);
+    else
+        free(p);
+}
+
+/* point the handle of a message allocation at its refcnt_blob_t */
+static blob_t *blob_from_alloc(void *p)
+{
+    blob_t *b = p;
+
+    BLOB_REF_PTR_set(b, (refcnt_blob_t *) (b + 1));
+    return b;
+}
+
+static pthread_once_t blob_stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t blob_stats_key;
+static __thread blob_stats_t *thread_blob_stats;
+
+/* the slot of an exited thread can be claimed again, the counts stay */
+static void blob_stats_release(void *arg)
+{
+    blob_stats_t *stats = arg;
+    RELAY_ATOMIC_AND(stats->owned, 0);
+}
+
+static void blob_stats_key_create(void)
+{
+    pthread_key_create(&blob_stats_key, blob_stats_release);
+}
+
+/* the accounting slot of this thread */
+static blob_stats_t *blob_stats_slot(void)
+{
+    blob_stats_t *stats = thread_blob_stats;
+
+    if (stats)
+        return stats;
+
+    pthread_once(&blob_stats_key_once, blob_stats_key_create);
+    for (int i = 1; i < BLOB_STATS_SLOTS; i++) {
+        if (!GLOBAL.blob_stats[i].owned && RELAY_ATOMIC_CMPXCHG(GLOBAL.blob_stats[i].owned, 0, 1)) {
+            stats = &GLOBAL.blob_stats[i];
+            pthread_setspecific(blob_stats_key, stats);
+            break;
+        }
+    }
+    if (!stats) {
+        WARN("Out of blob accounting slots, sharing one");
+        stats = &GLOBAL.blob_stats[0];
+    }
+    thread_blob_stats = stats;
+    return stats;
+}
+
+/* only the shared slot needs the atomics */
+#define BLOB_STATS_ADD(stats, name, v) do {             \
+    if ((stats) == GLOBAL.blob_stats) {                 \
+        RELAY_ATOMIC_INCREMENT((stats)->name, v);       \
+    } else {                                            \
+        (stats)->name += (v);                           \
+    }                                                   \
+} while (0)
+
+#define BLOB_STATS_OR(stats, name, v) do {              \
+    if ((stats) == GLOBAL.blob_stats) {                 \
+        RELAY_ATOMIC_OR((stats)->name, v);              \
+    } else {                                            \
+        (stats)->name |= (v);                           \
+    }                                                   \
+} while (0)
+
+/* the memory budget usage is updated only in steps of
+ * MEMORY_BUDGET_FLUSH_BYTES, so that it is not yet another hot atomic */
+static void budget_account(blob_stats_t * stats, int64_t bytes)
+{
+    if (stats == GLOBAL.blob_stats) {
+        RELAY_ATOMIC_INCREMENT(GLOBAL.budget.used_bytes, bytes);
+        return;
+    }
+    stats->budget_pending_bytes += bytes;
+    if (stats->budget_pending_bytes >= MEMORY_BUDGET_FLUSH_BYTES
+        || stats->budget_pending_bytes <= -MEMORY_BUDGET_FLUSH_BYTES) {
+        RELAY_ATOMIC_INCREMENT(GLOBAL.budget.used_bytes, stats->budget_pending_bytes);
+        stats->budget_pending_bytes = 0;
+    }
+}
+
 /* NOTE: only really handles allocs of up to 1<<32!
  * Would need a way to "count leading zeros" on 64-bit. */
-static void inc_blob_total_sizes(size_t size)
+static void inc_blob_total_sizes(blob_stats_t * stats, size_t size)
 {
     int bucket = size ? (32 - __builtin_clz((int) size - 1)) : 0;
-    if (bucket < 0 || bucket > (int) sizeof(GLOBAL.blob_total_sizes) / (int) sizeof(GLOBAL.blob_total_sizes[0])) {
+    if (bucket < 0 || bucket >= (int) sizeof(stats->total_sizes) / (int) sizeof(stats->total_sizes[0])) {
         return;                 /* should die, really */
     }
-    RELAY_ATOMIC_OR(GLOBAL.blob_total_ored_buckets, 1 << bucket);
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_total_sizes[bucket], 1);
+    BLOB_STATS_OR(stats, total_ored_buckets, 1 << bucket);
+    BLOB_STATS_ADD(stats, total_sizes[bucket], 1);
 }
 
-/* blob= blob_new(size) - create a new empty blob with space for size bytes */
-INLINE blob_t *blob_new(size_t size)
+/* blob_stats_sum(sum) - add up the accounting slots of all the threads */
+void blob_stats_sum(blob_stats_t * sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    for (int i = 0; i < BLOB_STATS_SLOTS; i++) {
+        blob_stats_t *stats = &GLOBAL.blob_stats[i];
+        sum->active_count += RELAY_ATOMIC_READ(stats->active_count);
+        sum->active_bytes += RELAY_ATOMIC_READ(stats->active_bytes);
+        sum->active_refcnt_bytes += RELAY_ATOMIC_READ(stats->active_refcnt_bytes);
+        sum->total_count += RELAY_ATOMIC_READ(stats->total_count);
+        sum->total_bytes += RELAY_ATOMIC_READ(stats->total_bytes);
+        sum->total_refcnt_bytes += RELAY_ATOMIC_READ(stats->total_refcnt_bytes);
+        for (int j = 0; j < (int) (sizeof(stats->total_sizes) / sizeof(stats->total_sizes[0])); j++)
+            sum->total_sizes[j] += RELAY_ATOMIC_READ(stats->total_sizes[j]);
+        sum->total_ored_buckets |= RELAY_ATOMIC_READ(stats->total_ored_buckets);
+    }
+}
+
+/* blob= blob_reserve(capacity) - allocate a blob with room for capacity
+ * bytes, to be received into directly.  The blob does not count as active
+ * until blob_commit(), and if it is never committed it must be released
+ * with blob_release_reserved().  The blob returned is the handle. */
+blob_t *blob_reserve(size_t capacity)
 {
     blob_t *b;
-    size_t refcnt_size;
 
-    b = malloc_or_fatal(sizeof(blob_t));
-    BLOB_NEXT_set(b, NULL);
-    refcnt_size = sizeof(refcnt_blob_t) + size;
-    BLOB_REF_PTR_set(b, malloc_or_fatal(refcnt_size));
-    BLOB_REFCNT_set(b, 1);      /* overwritten in enqueue_blob_for_transmision */
+    b = blob_from_alloc(blob_alloc(sizeof(blob_t) + sizeof(refcnt_blob_t) + capacity));
+    BLOB_REFCNT_set(b, 1);      /* overwritten in enqueue_blobs_for_transmission */
+    BLOB_BUF_SIZE_set(b, capacity);
+
+    return b;
+}
+
+/* With the blob pool a committed blob of at most this many bytes is moved
+ * to the chunk class that fits it: the copy is short, and it gives back
+ * most of the chunk reserved for the largest possible packet.  A larger
+ * blob is trimmed in place, without a copy, and the rest of its chunk is
+ * slack, which the memory budget counts too. */
+#define BLOB_POOL_MOVE_MAX 4096
+
+/* the bytes the allocation of a message really holds */
+static size_t blob_held_bytes(void *p, size_t alloc_size)
+{
+    return blob_pool_enabled()? blob_pool_chunk_size(p) : alloc_size;
+}
+
+/* blob= blob_commit(blob, size) - trim a reserved blob to the size bytes
+ * actually used, and account for it.  Shrinking normally happens in place,
+ * so the payload is not copied.  With the blob pool only the small blobs
+ * move, see BLOB_POOL_MOVE_MAX.  Either way the blob may move, so only the
+ * returned one is to be used. */
+blob_t *blob_commit(blob_t * b, size_t size)
+{
+    size_t refcnt_size = sizeof(refcnt_blob_t) + size;
+    size_t alloc_size = sizeof(blob_t) + refcnt_size;
+
+    if (size < BLOB_BUF_SIZE(b)) {
+        if (!blob_pool_enabled()) {
+            b = blob_from_alloc(realloc_or_fatal(b, alloc_size));
+        } else if (alloc_size <= BLOB_POOL_MOVE_MAX && blob_pool_fit_size(alloc_size) < blob_pool_chunk_size(b)) {
+            void *moved = blob_pool_alloc(alloc_size);
+            memcpy(moved, b, alloc_size);
+            blob_pool_free(b);
+            b = blob_from_alloc(moved);
+        }
+    }
     BLOB_BUF_SIZE_set(b, size);
 
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_active_count, 1);
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_active_bytes, sizeof(blob_t));
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_active_refcnt_bytes, refcnt_size);
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_total_count, 1);
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_total_bytes, sizeof(blob_t));
-    RELAY_ATOMIC_INCREMENT(GLOBAL.blob_total_refcnt_bytes, refcnt_size);
+    blob_stats_t *stats = blob_stats_slot();
+    BLOB_STATS_ADD(stats, active_count, 1);
+    BLOB_STATS_ADD(stats, active_bytes, sizeof(blob_t));
+    BLOB_STATS_ADD(stats, active_refcnt_bytes, refcnt_size);
+    BLOB_STATS_ADD(stats, total_count, 1);
+    BLOB_STATS_ADD(stats, total_bytes, sizeof(blob_t));
+    BLOB_STATS_ADD(stats, total_refcnt_bytes, refcnt_size);
+
+    inc_blob_total_sizes(stats, sizeof(blob_t));
+    inc_blob_total_sizes(stats, refcnt_size);
 
-    inc_blob_total_sizes(sizeof(blob_t));
-    inc_blob_total_sizes(refcnt_size);
+    budget_account(stats, blob_held_bytes(b, alloc_size));
 
     (void) get_time(&BLOB_RECEIVED_TIME(b));
 
     return b;
 }
 
+/* blob_release_reserved(blob) - free a blob that was never committed */
+void blob_release_reserved(blob_t * b)
+{
+    blob_free(b);
+}
+
+/* blob= blob_new(size) - create a new empty blob with space for size bytes */
+INLINE blob_t *blob_new(size_t size)
+{
+    return blob_commit(blob_reserve(size), size);
+}
+
 /* blob= blob_clone_no_refcnt_inc(a_blob) - lightweight clone of the original
  * note the refcount of the underlying _refcnt_blob_t is NOT
  * incremented, that must be done externally. */
 INLINE blob_t *blob_clone_no_refcnt_inc(blob_t * b)
 {
-    blob_t *cloned = malloc_or_fatal(sizeof(blob_t));
-    BLOB_NEXT_set(cloned, NULL);
+    blob_t *cloned = blob_alloc(sizeof(blob_t));
 
     /* Note we assume that BLOB_REFCNT(b) is setup externally
      * so we do NOT set the refcnt when we do this.
@@ -89,43 +263,99 @@ INLINE blob_t *blob_clone_no_refcnt_inc(blob_t * b)
 /* blob_destroy(blob) - destroy a blob object */
 void blob_destroy(blob_t * b)
 {
-    if (BLOB_REF_PTR(b)) {
+    refcnt_blob_t *ref = BLOB_REF_PTR(b);
+
+    if (ref && BLOB_REFCNT(b) == BLOB_REFCNT_LOGGED) {
+        /* a fanout log reader node, just let the log know we are done */
+        (void) RELAY_ATOMIC_CMPXCHG(BLOB_REF_PTR(b), ref, NULL);
+        return;
+    }
+    /* the handle goes with the message, so look before letting go of it */
+    int is_handle = ref && BLOB_IS_HANDLE(b);
+    if (ref) {
         int32_t refcnt = RELAY_ATOMIC_DECREMENT(BLOB_REFCNT(b), 1);
         if (refcnt <= 1) {
-            /* we were the last owner so we can release it */
-            RELAY_ATOMIC_DECREMENT(GLOBAL.blob_active_refcnt_bytes, sizeof(refcnt_blob_t) + BLOB_BUF_SIZE(b));
-            free(BLOB_REF_PTR(b));
+            /* we were the last owner so we can release it,
+             * and it stops counting as active */
+            blob_stats_t *stats = blob_stats_slot();
+            BLOB_STATS_ADD(stats, active_refcnt_bytes, -(int64_t) (sizeof(refcnt_blob_t) + BLOB_BUF_SIZE(b)));
+            BLOB_STATS_ADD(stats, active_bytes, -(int64_t) sizeof(blob_t));
+            BLOB_STATS_ADD(stats, active_count, -1);
+            size_t alloc_size = sizeof(blob_t) + sizeof(refcnt_blob_t) + BLOB_BUF_SIZE(b);
+            budget_account(stats, -(int64_t) blob_held_bytes(BLOB_HANDLE(b), alloc_size));
+            blob_free(BLOB_HANDLE(b));
         }
     }
-    RELAY_ATOMIC_DECREMENT(GLOBAL.blob_active_bytes, sizeof(blob_t));
-    RELAY_ATOMIC_DECREMENT(GLOBAL.blob_active_count, 1);
-    free(b);
+    if (!is_handle)
+        blob_free(b);
+}
+
+
+static queue_chunk_t *queue_chunk_new(void)
+{
+    queue_chunk_t *chunk = blob_alloc(sizeof(queue_chunk_t));
+    chunk->next = NULL;
+    chunk->first = chunk->last = 0;
+    return chunk;
 }
 
+/* link a chunk at the tail of a queue, or if its blobs fit into the room
+ * left in the tail chunk, copy them there and free it: so the many small
+ * batches pushed to a worker do not end up a chunk each.  The count is
+ * left to the caller. */
+static void queue_append_chunk_nolock(queue_t * q, queue_chunk_t * chunk)
+{
+    queue_chunk_t *tail = q->tail;
+    uint32_t n = chunk->last - chunk->first;
+
+    if (tail && tail->last + n <= QUEUE_CHUNK_BLOBS) {
+        memcpy(&tail->blobs[tail->last], &chunk->blobs[chunk->first], n * sizeof(blob_t *));
+        tail->last += n;
+        blob_free(chunk);
+        return;
+    }
+
+    chunk->next = NULL;
+    if (tail)
+        tail->next = chunk;
+    else
+        q->head = chunk;
+    q->tail = chunk;
+}
 
 /* append an item to queue non-safely */
 uint32_t queue_append_nolock(queue_t * q, blob_t * b)
 {
-    if (q->head == NULL)
-        q->head = b;
-    else
-        BLOB_NEXT_set(q->tail, b);
+    queue_chunk_t *tail = q->tail;
 
-    q->tail = b;
-    BLOB_NEXT_set(b, NULL);
+    if (tail == NULL || tail->last == QUEUE_CHUNK_BLOBS) {
+        tail = queue_chunk_new();
+        if (q->tail)
+            q->tail->next = tail;
+        else
+            q->head = tail;
+        q->tail = tail;
+    }
+
+    tail->blobs[tail->last++] = b;
     return ++(q->count);
 }
 
 uint32_t queue_append_tail_nolock(queue_t * q, queue_t * tail)
 {
+    queue_chunk_t *chunk = tail->head;
 
-    if (q->head == NULL)
-        q->head = tail->head;
-    else
-        BLOB_NEXT_set(q->tail, tail->head);
+    if (chunk) {
+        queue_chunk_t *rest = chunk->next;
 
-    q->tail = tail->tail;
-    q->count += tail->count;
+        /* only the first chunk may be merged, the rest follow it as they are */
+        queue_append_chunk_nolock(q, chunk);
+        if (rest) {
+            q->tail->next = rest;
+            q->tail = tail->tail;
+        }
+        q->count += tail->count;
+    }
 
     tail->head = NULL;
     tail->tail = NULL;
@@ -155,19 +385,86 @@ uint32_t queue_append(queue_t * q, blob_t * b, LOCK_T * lock)
 /* shift an item out of a queue non-safely */
 blob_t *queue_shift_nolock(queue_t * q)
 {
-    blob_t *b = q->head;
-    if (b) {
-        if (BLOB_NEXT(b))
-            q->head = BLOB_NEXT(b);
-        else
-            q->head = q->tail = NULL;
-        q->count--;
+    queue_chunk_t *chunk = q->head;
+    blob_t *b;
+
+    if (chunk == NULL)
+        return NULL;
+
+    b = chunk->blobs[chunk->first++];
+    if (chunk->first == chunk->last) {
+        q->head = chunk->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        blob_free(chunk);
     }
+    q->count--;
     return b;
 }
 
+/* move the first n items of a queue to the (empty) head queue, return
+ * the number moved.  The whole chunks are moved as they are, only the
+ * one the split falls into is copied from. */
+uint32_t queue_split_nolock(queue_t * q, queue_t * head, uint32_t n)
+{
+    if (n >= q->count)
+        return queue_hijack_nolock(q, head);
+
+    head->head = head->tail = NULL;
+    head->count = 0;
+
+    while (n) {
+        queue_chunk_t *chunk = q->head;
+        uint32_t in_chunk = chunk->last - chunk->first;
+
+        if (in_chunk <= n) {
+            q->head = chunk->next;
+        } else {
+            queue_chunk_t *part = queue_chunk_new();
+            memcpy(part->blobs, &chunk->blobs[chunk->first], n * sizeof(blob_t *));
+            part->last = n;
+            chunk->first += n;
+            chunk = part;
+            in_chunk = n;
+        }
+        queue_append_chunk_nolock(head, chunk);
+        head->count += in_chunk;
+        q->count -= in_chunk;
+        n -= in_chunk;
+    }
 
+    return head->count;
+}
+
+/* a copy of a queue, sharing the items, return the number of items */
+uint32_t queue_copy_nolock(queue_t * q, queue_t * copy)
+{
+    copy->head = copy->tail = NULL;
+    copy->count = 0;
+
+    for (queue_chunk_t * chunk = q->head; chunk; chunk = chunk->next) {
+        queue_chunk_t *part = queue_chunk_new();
+        uint32_t n = chunk->last - chunk->first;
+
+        memcpy(part->blobs, &chunk->blobs[chunk->first], n * sizeof(blob_t *));
+        part->last = n;
+        queue_append_chunk_nolock(copy, part);
+        copy->count += n;
+    }
+
+    return copy->count;
+}
 
+/* empty a queue without destroying its items */
+void queue_clear_nolock(queue_t * q)
+{
+    for (queue_chunk_t * chunk = q->head, *next; chunk; chunk = next) {
+        next = chunk->next;
+        blob_free(chunk);
+    }
+    q->head = q->tail = NULL;
+    q->count = 0;
+}
 
 /* shift an item out of a queue, optionally locked*/
 blob_t *queue_shift(queue_t * q, LOCK_T * lock)
@@ -198,3 +495,142 @@ uint32_t queue_hijack(queue_t * q, queue_t * hijacked_queue, LOCK_T * lock)
     UNLOCK(lock);
     return count;
 }
+
+#ifdef HAVE_FUTEX
+/* The waiter and the wakers are all threads of this process. */
+static int futex_wait(volatile uint32_t * addr, uint32_t val, unsigned timeout_millisec)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout_millisec / 1000;
+    ts.tv_nsec = (timeout_millisec % 1000) * 1000000L;
+    return (int) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static int futex_wake(volatile uint32_t * addr)
+{
+    return (int) syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
+
+static void mpsc_queue_ring(mpsc_queue_t * q)
+{
+    __atomic_add_fetch(&q->doorbell, 1, __ATOMIC_SEQ_CST);
+#ifdef HAVE_FUTEX
+    futex_wake(&q->doorbell);
+#endif
+}
+
+void mpsc_queue_wake(mpsc_queue_t * q)
+{
+    /* the work may have been published by a mere release store */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST))
+        mpsc_queue_ring(q);
+}
+
+static int mpsc_queue_ready(const mpsc_queue_t * q, const volatile uint64_t * also, uint64_t also_seen)
+{
+    return __atomic_load_n(&q->top, __ATOMIC_SEQ_CST) != NULL
+        || (also && __atomic_load_n(also, __ATOMIC_SEQ_CST) != also_seen);
+}
+
+/* How many times to look at the queue between the clock readings. */
+#define MPSC_QUEUE_SPIN_LOOKS 64
+
+int mpsc_queue_park(mpsc_queue_t * q, uint32_t spin_usec, uint32_t timeout_millisec,
+                    const volatile uint64_t * also, uint64_t also_seen)
+{
+    if (spin_usec) {
+        struct timeval start, now;
+        get_time(&start);
+        do {
+            for (int i = 0; i < MPSC_QUEUE_SPIN_LOOKS; i++) {
+                if (mpsc_queue_ready(q, also, also_seen))
+                    return 1;
+#if defined(__x86_64__) || defined(__i386__)
+                __builtin_ia32_pause();
+#endif
+            }
+            get_time(&now);
+        } while (elapsed_usec(&start, &now) < spin_usec);
+    }
+
+#ifdef HAVE_FUTEX
+    uint32_t doorbell = __atomic_load_n(&q->doorbell, __ATOMIC_SEQ_CST);
+
+    /* Announce the sleep before the last look at the queue: a producer
+     * either sees the flag and rings, or we see its push. */
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!mpsc_queue_ready(q, also, also_seen))
+        futex_wait(&q->doorbell, doorbell, timeout_millisec);
+    __atomic_store_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+#else
+    /* No futex, poll every millisecond as before. */
+    for (uint32_t waited = 0; waited < timeout_millisec && !mpsc_queue_ready(q, also, also_seen); waited++)
+        usleep(1000);
+#endif
+
+    return mpsc_queue_ready(q, also, also_seen);
+}
+
+/* append a queue to a lock-free queue, emptying it */
+void mpsc_queue_append_tail(mpsc_queue_t * q, queue_t * tail)
+{
+    queue_chunk_t *reversed = NULL;
+    queue_chunk_t *last = tail->head;
+    queue_chunk_t *top;
+
+    if (last == NULL)
+        return;
+
+    /* the stack is newest first, so push the chunks reversed */
+    for (queue_chunk_t * chunk = tail->head, *next; chunk; chunk = next) {
+        next = chunk->next;
+        chunk->next = reversed;
+        reversed = chunk;
+    }
+
+    do {
+        top = q->top;
+        last->next = top;
+    } while (!RELAY_ATOMIC_CMPXCHG(q->top, top, reversed));
+
+    tail->head = NULL;
+    tail->tail = NULL;
+    tail->count = 0;
+
+    /* The consumer parks only on an empty stack.  The compare-and-swap is
+     * a full barrier, so see mpsc_queue_park() for why this is enough. */
+    if (top == NULL && q->sleeping)
+        mpsc_queue_ring(q);
+}
+
+/* hijack all of a lock-free queue into a separate structure, in arrival
+ * order, return the number of items hijacked */
+uint32_t mpsc_queue_hijack(mpsc_queue_t * q, queue_t * hijacked_queue)
+{
+    queue_chunk_t *top;
+    queue_chunk_t *ordered = NULL;
+
+    hijacked_queue->head = hijacked_queue->tail = NULL;
+    hijacked_queue->count = 0;
+
+    do {
+        top = q->top;
+        if (top == NULL)
+            return 0;
+    } while (!RELAY_ATOMIC_CMPXCHG(q->top, top, NULL));
+
+    for (queue_chunk_t * chunk = top, *next; chunk; chunk = next) {
+        next = chunk->next;
+        chunk->next = ordered;
+        ordered = chunk;
+    }
+    /* the chunks of the small batches get merged on the way */
+    for (queue_chunk_t * chunk = ordered, *next; chunk; chunk = next) {
+        next = chunk->next;
+        hijacked_queue->count += chunk->last - chunk->first;
+        queue_append_chunk_nolock(hijacked_queue, chunk);
+    }
+    return hijacked_queue->count;
+}
@@ -6,6 +6,7 @@
 #include <sys/time.h>
 #include <stdio.h>
 
+#include "relay_common.h"
 #include "relay_threads.h"
 
 /* The size of the blob.  Note that the wire format is LITTLE-ENDIAN. */
@@ -39,28 +40,96 @@ typedef struct data_blob data_blob_t;
  * the lock to guard refcnt modifications */
 struct refcnt_blob {
     volatile int32_t refcnt;
-    struct timeval received_time;
+    struct timeval received_time;       /* of the monotonic clock, see timer.h */
     data_blob_t data;
 };
 typedef struct refcnt_blob refcnt_blob_t;
 
-/* this structure is private to each thread */
+/* A message is a single allocation: its handle, the blob_t, right in
+ * front of the refcnt_blob_t.  The queues hold pointers to the handle,
+ * so every destination queues the same one, and only the clones (and the
+ * fanout log nodes) are allocated separately. */
 struct blob {
-    struct blob *next;
     refcnt_blob_t *ref;
 };
 typedef struct blob blob_t;
 
+/* The queues keep the blobs in chunks of QUEUE_CHUNK_BLOBS pointers (a
+ * chunk is 1KB), so walking a long backlog reads the pointers in order
+ * and can prefetch the blobs ahead, instead of following a pointer from
+ * each blob to the next.  The chunks are freed as they empty, so an
+ * empty queue has none. */
+#define QUEUE_CHUNK_BLOBS           126
+
+/* How many blobs ahead of a cursor are prefetched. */
+#define QUEUE_PREFETCH_BLOBS        8
+
+struct queue_chunk {
+    struct queue_chunk *next;
+    /* the blobs still queued are blobs[first] to blobs[last - 1] */
+    uint32_t first;
+    uint32_t last;
+    blob_t *blobs[QUEUE_CHUNK_BLOBS];
+};
+typedef struct queue_chunk queue_chunk_t;
+
 struct queue {
     LOCK_T lock;
-    blob_t *head;
-    blob_t *tail;
+    queue_chunk_t *head;
+    queue_chunk_t *tail;
     uint32_t count;
 };
 typedef struct queue queue_t;
 
+/* Walks a queue in order, see queue_cursor_start(). */
+struct queue_cursor {
+    queue_chunk_t *chunk;
+    uint32_t i;
+};
+typedef struct queue_cursor queue_cursor_t;
+
+/* A multi-producer single-consumer queue without locks.  The producers
+ * push the chunks of their queues onto a stack, so it holds the chunks
+ * newest first, and the consumer takes the whole stack at once and
+ * reverses it back into arrival order.  Nothing is ever popped off one at
+ * a time, so there is no ABA problem.
+ *
+ * With nothing to do the consumer parks on the doorbell, see
+ * mpsc_queue_park(), and a producer pushing onto the empty stack rings it
+ * if the consumer is sleeping, so a busy queue costs no system calls. */
+struct mpsc_queue {
+    queue_chunk_t *volatile top;
+    volatile uint32_t doorbell;
+    volatile uint32_t sleeping;
+};
+typedef struct mpsc_queue mpsc_queue_t;
+
+/* The blob accounting.  Every thread allocating or freeing blobs updates
+ * a slot of its own, padded to its own cache lines, without atomics, and
+ * the slots are summed only by the readers, with blob_stats_sum(). */
+struct blob_stats {
+    int64_t active_count;
+    int64_t active_bytes;
+    int64_t active_refcnt_bytes;
+    int64_t total_count;
+    int64_t total_bytes;
+    int64_t total_refcnt_bytes;
+    int64_t total_sizes[32];    /* ceil(log2(size)) buckets */
+    int64_t total_ored_buckets; /* OR of all the seen bucket indices */
+    /* the bytes not yet added to the memory budget usage */
+    int64_t budget_pending_bytes;
+    /* Claimed by a thread.  The threads left without a slot of their own
+     * share the slot 0, which is updated with atomics. */
+    volatile int32_t owned;
+} __attribute__ ((aligned(64)));
+typedef struct blob_stats blob_stats_t;
+
+#define BLOB_STATS_SLOTS 128
+
+/* The refcount of a blob owned by the fanout log, see fanout_log.h. */
+#define BLOB_REFCNT_LOGGED          INT32_MIN
+
 #define BLOB_REF_PTR(B)             ((B)->ref)
-#define BLOB_NEXT(B)                ((B)->next)
 
 #define BLOB_DATA_MBR(B)            (BLOB_REF_PTR(B)->data)
 #define BLOB_DATA_MBR_addr(B)       (&BLOB_DATA_MBR(B))
@@ -73,10 +142,12 @@ typedef struct queue queue_t;
 #define BLOB_BUF_addr(B)            (&BLOB_BUF(B))
 
 #define BLOB_DATA_MBR_SIZE(B)       (BLOB_BUF_SIZE(B) + sizeof(BLOB_BUF_SIZE(B)))
+
+#define BLOB_HANDLE(B)              ((blob_t *) BLOB_REF_PTR(B) - 1)
+#define BLOB_IS_HANDLE(B)           ((B) == BLOB_HANDLE(B))
 /* --- */
 
 #define BLOB_REF_PTR_set(B, v)      (B)->ref= (v)
-#define BLOB_NEXT_set(B, v)         (B)->next = (v)
 
 #define BLOB_REFCNT_set(B, v)       BLOB_REF_PTR(B)->refcnt = (v)
 #define BLOB_REFCNT_dec(B)          BLOB_REF_PTR(B)->refcnt--
@@ -90,18 +161,72 @@ void *realloc_or_fatal(void *p, size_t size);
 void *malloc_or_fatal(size_t size);
 void *calloc_or_fatal(size_t size);
 blob_t *blob_new(size_t size);
+blob_t *blob_reserve(size_t capacity);
+blob_t *blob_commit(blob_t * b, size_t size);
+void blob_release_reserved(blob_t * b);
 blob_t *blob_clone_no_refcnt_inc(blob_t * b);
 void blob_destroy(blob_t * b);
+void blob_stats_sum(blob_stats_t * sum);
 
 /* queue stuff */
 uint32_t queue_append_nolock(queue_t * q, blob_t * b);
 uint32_t queue_append_tail_nolock(queue_t * q, queue_t * tail);
 blob_t *queue_shift_nolock(queue_t * q);
 uint32_t queue_hijack_nolock(queue_t * q, queue_t * hijacked_queue);
+uint32_t queue_split_nolock(queue_t * q, queue_t * head, uint32_t n);
+uint32_t queue_copy_nolock(queue_t * q, queue_t * copy);
+void queue_clear_nolock(queue_t * q);
 
 uint32_t queue_append(queue_t * q, blob_t * b, LOCK_T * lock);
 uint32_t queue_append_tail(queue_t * q, queue_t * tail, LOCK_T * lock);
 blob_t *queue_shift(queue_t * q, LOCK_T * lock);
 uint32_t queue_hijack(queue_t * q, queue_t * hijacked_queue, LOCK_T * lock);
 
+void mpsc_queue_append_tail(mpsc_queue_t * q, queue_t * tail);
+uint32_t mpsc_queue_hijack(mpsc_queue_t * q, queue_t * hijacked_queue);
+
+/* Spin for spin_usec, then sleep for at most timeout_millisec, until
+ * something is pushed onto the queue, or the queue is woken.  If also is
+ * not NULL, it is another source of work for the consumer, which has some
+ * while *also differs from also_seen.  Returns 1 if there is work. */
+int mpsc_queue_park(mpsc_queue_t * q, uint32_t spin_usec, uint32_t timeout_millisec,
+                    const volatile uint64_t * also, uint64_t also_seen);
+/* Wake the consumer if it is parked: for the other sources of its work,
+ * and for the stopping. */
+void mpsc_queue_wake(mpsc_queue_t * q);
+
+/* the first blob of a queue, or NULL if it is empty */
+static INLINE blob_t *queue_peek(const queue_t * q)
+{
+    return q->head ? q->head->blobs[q->head->first] : NULL;
+}
+
+/* the blob at a cursor, or NULL past the end */
+static INLINE blob_t *queue_cursor_blob(const queue_cursor_t * c)
+{
+    if (!c->chunk)
+        return NULL;
+    if (c->i + QUEUE_PREFETCH_BLOBS < c->chunk->last)
+        __builtin_prefetch(c->chunk->blobs[c->i + QUEUE_PREFETCH_BLOBS]);
+    return c->chunk->blobs[c->i];
+}
+
+/* for (b = queue_cursor_start(&c, q); b; b = queue_cursor_next(&c)) walks
+ * the blobs of a queue, which must not change meanwhile */
+static INLINE blob_t *queue_cursor_start(queue_cursor_t * c, const queue_t * q)
+{
+    c->chunk = q->head;
+    c->i = c->chunk ? c->chunk->first : 0;
+    return queue_cursor_blob(c);
+}
+
+static INLINE blob_t *queue_cursor_next(queue_cursor_t * c)
+{
+    if (++c->i >= c->chunk->last) {
+        c->chunk = c->chunk->next;
+        c->i = c->chunk ? c->chunk->first : 0;
+    }
+    return queue_cursor_blob(c);
+}
+
 #endif                          /* #ifndef RELAY_BLOB_H */
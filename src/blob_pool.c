@@ -0,0 +1,220 @@
+#include "blob_pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob.h"
+#include "log.h"
+#include "relay_common.h"
+#include "relay_threads.h"
+
+/* The classes of the powers of two, then the one of the largest blob. */
+#define BLOB_POOL_MIN_SHIFT 4
+#define BLOB_POOL_MAX_SHIFT 16
+#define BLOB_POOL_CLASSES (BLOB_POOL_MAX_SHIFT - BLOB_POOL_MIN_SHIFT + 2)
+#define BLOB_POOL_LARGEST ((sizeof(blob_t) + sizeof(refcnt_blob_t) + MAX_CHUNK_SIZE + 15) & ~(size_t) 15)
+
+#define BLOB_POOL_SLAB_BYTES (256 * 1024)
+/* The chunks start after the slab header, aligned. */
+#define BLOB_POOL_SLAB_HEADER 64
+
+struct blob_pool_chunk {
+    struct blob_pool_chunk *next;
+};
+
+struct blob_pool_cache {
+    /* Touched only by the thread owning the cache. */
+    struct blob_pool_chunk *free[BLOB_POOL_CLASSES];
+    /* Pushed to by the other threads. */
+    struct blob_pool_chunk *volatile returned[BLOB_POOL_CLASSES];
+    /* Set once the owning thread has exited. */
+    int orphaned;
+    struct blob_pool_cache *next;
+};
+
+struct blob_pool_slab {
+    /* NULL for a slab of its own */
+    struct blob_pool_cache *owner;
+    uint32_t size_class;
+    size_t chunk_size;
+};
+
+static int pool_enabled;
+static int64_t pool_slab_bytes;
+
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct blob_pool_cache *caches;
+static __thread struct blob_pool_cache *thread_cache;
+
+void blob_pool_init(int enabled)
+{
+    pool_enabled = enabled;
+}
+
+int blob_pool_enabled(void)
+{
+    return pool_enabled;
+}
+
+int64_t blob_pool_slab_bytes(void)
+{
+    return RELAY_ATOMIC_READ(pool_slab_bytes);
+}
+
+/* BLOB_POOL_CLASSES if too large for any */
+static uint32_t size_class(size_t size)
+{
+    if (size > BLOB_POOL_LARGEST)
+        return BLOB_POOL_CLASSES;
+    if (size <= (1 << BLOB_POOL_MIN_SHIFT))
+        return 0;
+    if (size > (1 << BLOB_POOL_MAX_SHIFT))
+        return BLOB_POOL_CLASSES - 1;
+    return 32 - __builtin_clz((unsigned) size - 1) - BLOB_POOL_MIN_SHIFT;
+}
+
+static size_t class_size(uint32_t c)
+{
+    return c == BLOB_POOL_CLASSES - 1 ? BLOB_POOL_LARGEST : (size_t) 1 << (c + BLOB_POOL_MIN_SHIFT);
+}
+
+static struct blob_pool_slab *chunk_slab(void *p)
+{
+    return (struct blob_pool_slab *) ((uintptr_t) p & ~(uintptr_t) (BLOB_POOL_SLAB_BYTES - 1));
+}
+
+size_t blob_pool_chunk_size(void *p)
+{
+    return chunk_slab(p)->chunk_size;
+}
+
+size_t blob_pool_fit_size(size_t size)
+{
+    uint32_t c = size_class(size);
+    return c == BLOB_POOL_CLASSES ? size : class_size(c);
+}
+
+static void cache_orphan(void *arg)
+{
+    struct blob_pool_cache *cache = arg;
+    pthread_mutex_lock(&caches_lock);
+    cache->orphaned = 1;
+    pthread_mutex_unlock(&caches_lock);
+}
+
+static void cache_key_create(void)
+{
+    pthread_key_create(&cache_key, cache_orphan);
+}
+
+/* The cache of this thread, adopting the one of an exited thread if there
+ * is one, so that the listener threads restarted by a reload do not leave
+ * their free chunks behind. */
+static struct blob_pool_cache *cache_get(void)
+{
+    struct blob_pool_cache *cache = thread_cache;
+
+    if (cache)
+        return cache;
+
+    pthread_once(&cache_key_once, cache_key_create);
+    pthread_mutex_lock(&caches_lock);
+    for (cache = caches; cache; cache = cache->next) {
+        if (cache->orphaned) {
+            cache->orphaned = 0;
+            break;
+        }
+    }
+    if (!cache) {
+        cache = calloc_or_fatal(sizeof(*cache));
+        cache->next = caches;
+        caches = cache;
+    }
+    pthread_mutex_unlock(&caches_lock);
+
+    pthread_setspecific(cache_key, cache);
+    thread_cache = cache;
+    return cache;
+}
+
+static struct blob_pool_slab *slab_alloc(size_t bytes, struct blob_pool_cache *owner, uint32_t c, size_t chunk_size)
+{
+    void *p;
+    if (posix_memalign(&p, BLOB_POOL_SLAB_BYTES, bytes))
+        FATAL("Unable to allocate a blob pool slab of %zu bytes", bytes);
+    RELAY_ATOMIC_INCREMENT(pool_slab_bytes, bytes);
+
+    struct blob_pool_slab *slab = p;
+    slab->owner = owner;
+    slab->size_class = c;
+    slab->chunk_size = chunk_size;
+    return slab;
+}
+
+/* Carve a new slab into a list of free chunks. */
+static struct blob_pool_chunk *slab_new(struct blob_pool_cache *cache, uint32_t c)
+{
+    size_t size = class_size(c);
+    char *p = (char *) slab_alloc(BLOB_POOL_SLAB_BYTES, cache, c, size);
+    struct blob_pool_chunk *head = NULL;
+    for (size_t offset = BLOB_POOL_SLAB_HEADER; offset + size <= BLOB_POOL_SLAB_BYTES; offset += size) {
+        struct blob_pool_chunk *chunk = (struct blob_pool_chunk *) (p + offset);
+        chunk->next = head;
+        head = chunk;
+    }
+    return head;
+}
+
+void *blob_pool_alloc(size_t size)
+{
+    uint32_t c = size_class(size);
+
+    if (c == BLOB_POOL_CLASSES) {
+        /* too large to pool, gets a slab of its own */
+        return (char *) slab_alloc(BLOB_POOL_SLAB_HEADER + size, NULL, c, size) + BLOB_POOL_SLAB_HEADER;
+    }
+
+    struct blob_pool_cache *cache = cache_get();
+    struct blob_pool_chunk *chunk = cache->free[c];
+
+    if (!chunk) {
+        /* take back everything the other threads have freed */
+        do {
+            chunk = cache->returned[c];
+        } while (chunk && !RELAY_ATOMIC_CMPXCHG(cache->returned[c], chunk, NULL));
+        if (!chunk)
+            chunk = slab_new(cache, c);
+    }
+    cache->free[c] = chunk->next;
+
+    return chunk;
+}
+
+void blob_pool_free(void *p)
+{
+    struct blob_pool_slab *slab = chunk_slab(p);
+    struct blob_pool_cache *owner = slab->owner;
+    struct blob_pool_chunk *chunk = p;
+    uint32_t c = slab->size_class;
+
+    if (owner == NULL) {
+        RELAY_ATOMIC_DECREMENT(pool_slab_bytes, BLOB_POOL_SLAB_HEADER + slab->chunk_size);
+        free(slab);
+        return;
+    }
+    if (owner == thread_cache) {
+        chunk->next = owner->free[c];
+        owner->free[c] = chunk;
+        return;
+    }
+
+    /* Only ever pushed to, and taken all at once, so no ABA. */
+    struct blob_pool_chunk *top;
+    do {
+        top = owner->returned[c];
+        chunk->next = top;
+    } while (!RELAY_ATOMIC_CMPXCHG(owner->returned[c], top, chunk));
+}
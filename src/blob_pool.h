@@ -0,0 +1,38 @@
+#ifndef RELAY_BLOB_POOL_H
+#define RELAY_BLOB_POOL_H
+
+/* The relay's own allocator for the blobs (blob_pool=1), as opposed to
+ * malloc(), whichever malloc() that is.
+ *
+ * The chunks come in size classes, the powers of two from 16 bytes (the
+ * cloned handles) up to 64 kilobytes, matching the log2 buckets of the blob
+ * sizes, and one more class for the largest possible blob.  Each class
+ * is carved out of slabs, aligned to their size, so a chunk finds its
+ * slab, and so its class and owner, from its address alone.  Anything
+ * larger (a big shared memory frame) gets a slab of its own, freed with it.
+ *
+ * Every allocating thread has a cache of free chunks per class.  The
+ * chunks freed by other threads (the workers free what the listeners
+ * allocate) go back to their owner through a lock-free return list,
+ * which the owner takes all at once when its own free list runs out.
+ * The caches of exited threads are adopted by the new ones.
+ *
+ * The memory is never returned to the system. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+void blob_pool_init(int enabled);
+int blob_pool_enabled(void);
+
+void *blob_pool_alloc(size_t size);
+void blob_pool_free(void *p);
+/* The number of bytes the chunk of p can hold. */
+size_t blob_pool_chunk_size(void *p);
+/* The number of bytes a chunk for size would hold. */
+size_t blob_pool_fit_size(size_t size);
+
+/* The bytes taken by the slabs so far. */
+int64_t blob_pool_slab_bytes(void);
+
+#endif                          /* #ifndef RELAY_BLOB_POOL_H */
@@ -8,6 +8,7 @@
 
 #include "global.h"
 #include "log.h"
+#include "memory_budget.h"
 #include "socket_worker.h"
 #include "string_util.h"
 
@@ -24,6 +25,9 @@ void config_destroy(config_t * config)
     free(config->spill_root);
     free(config->config_file);
     free(config->lock_file);
+    free(config->listener_filter_prefix);
+    free(config->memory_budget_policy);
+    free(config->worker_queue_policy);
     for (int i = 0; i < (int) config->malloc.stats_mib_count; i++) {
         free(config->malloc.stats_mib[i].mib);
     }
@@ -44,6 +48,17 @@ void config_set_defaults(config_t * config)
     config->server_socket_rcvbuf_bytes = DEFAULT_SERVER_SOCKET_RCVBUF_BYTES;
     config->server_socket_sndbuf_bytes = DEFAULT_SERVER_SOCKET_SNDBUF_BYTES;
     config->max_socket_open_wait_millisec = DEFAULT_MAX_SOCKET_OPEN_WAIT_MILLISEC;
+    config->listener_threads = DEFAULT_LISTENER_THREADS;
+    config->udp_recv_batch = DEFAULT_UDP_RECV_BATCH;
+    config->tcp_send_batch = DEFAULT_TCP_SEND_BATCH;
+    config->udp_gro = DEFAULT_UDP_GRO;
+    config->io_uring = DEFAULT_IO_URING;
+    config->shm_ring_bytes = DEFAULT_SHM_RING_BYTES;
+    config->fanout_log_slots = DEFAULT_FANOUT_LOG_SLOTS;
+    config->blob_pool = DEFAULT_BLOB_POOL;
+    config->listener_filter_min_bytes = DEFAULT_LISTENER_FILTER_MIN_BYTES;
+    config->listener_filter_max_bytes = DEFAULT_LISTENER_FILTER_MAX_BYTES;
+    config->listener_filter_prefix = strdup(DEFAULT_LISTENER_FILTER_PREFIX);
 
     config->lock_file = strdup(DEFAULT_LOCK_FILE);
 
@@ -55,6 +70,15 @@ void config_set_defaults(config_t * config)
     config->spill_grace_millisec = DEFAULT_SPILL_GRACE_MILLISEC;
     config->spill_root = strdup(DEFAULT_SPILL_ROOT);
 
+    config->memory_budget_mb = DEFAULT_MEMORY_BUDGET_MB;
+    config->memory_budget_policy = strdup(DEFAULT_MEMORY_BUDGET_POLICY);
+    config->memory_budget_shed_millisec = DEFAULT_MEMORY_BUDGET_SHED_MILLISEC;
+    config->worker_queue_max_items = DEFAULT_WORKER_QUEUE_MAX_ITEMS;
+    config->worker_queue_max_bytes = DEFAULT_WORKER_QUEUE_MAX_BYTES;
+    config->worker_queue_policy = strdup(DEFAULT_WORKER_QUEUE_POLICY);
+    config->worker_spin_usec = DEFAULT_WORKER_SPIN_USEC;
+    config->worker_park_millisec = DEFAULT_WORKER_PARK_MILLISEC;
+
     config->graphite.dest_addr = strdup(DEFAULT_GRAPHITE_DEST_ADDR);
     config->graphite.path_root = strdup(DEFAULT_GRAPHITE_PATH_ROOT);
     config->graphite.add_ports = DEFAULT_GRAPHITE_ADD_PORTS;
@@ -140,6 +164,70 @@ static int is_valid_buffer_size(uint32_t size)
     return (size >= ONE_MEGABYTE && ((size & (ONE_MEGABYTE - 1)) == 0));
 }
 
+static int is_valid_listener_threads(uint32_t threads)
+{
+    return threads > 0 && threads <= MAX_LISTENER_THREADS;
+}
+
+/* The kernel caps the recvmmsg() vector length at UIO_MAXIOV (1024). */
+#define MAX_UDP_RECV_BATCH 1024
+
+static int is_valid_udp_recv_batch(uint32_t batch)
+{
+    return batch > 0 && batch <= MAX_UDP_RECV_BATCH;
+}
+
+/* One iovec per blob, and the kernel caps the sendmsg() vector length
+ * at UIO_MAXIOV (1024) too. */
+#define MAX_TCP_SEND_BATCH 1024
+
+static int is_valid_tcp_send_batch(uint32_t batch)
+{
+    return batch > 0 && batch <= MAX_TCP_SEND_BATCH;
+}
+
+/* Big enough for the largest frame, and a power of two. */
+static int is_valid_shm_ring_bytes(uint32_t bytes)
+{
+    return bytes >= 2 * (MAX_CHUNK_SIZE + 1) && bytes <= (1U << 30) && (bytes & (bytes - 1)) == 0;
+}
+
+/* Zero for none, or a power of two. */
+static int is_valid_fanout_log_slots(uint32_t slots)
+{
+    return slots == 0 || (slots >= 1024 && slots <= (1U << 24) && (slots & (slots - 1)) == 0);
+}
+
+static int is_valid_memory_budget_policy(const char *policy)
+{
+    return memory_budget_policy_parse(policy) >= 0;
+}
+
+/* The same policies as for the memory budget, less the pausing. */
+static int is_valid_worker_queue_policy(const char *policy)
+{
+    int parsed = memory_budget_policy_parse(policy);
+    return parsed >= 0 && parsed != MEMORY_BUDGET_PAUSE;
+}
+
+/* Spinning is for shaving off the wakeup latency, so a millisecond of
+ * it is plenty. */
+static int is_valid_worker_spin_usec(uint32_t usec)
+{
+    return usec <= 1000;
+}
+
+static int is_valid_listener_filter_bytes(uint32_t bytes)
+{
+    return bytes <= MAX_CHUNK_SIZE;
+}
+
+static int is_valid_listener_filter_prefix(const char *prefix)
+{
+    unsigned char bytes[MAX_LISTENER_FILTER_PREFIX];
+    return hex_decode(prefix, bytes, sizeof(bytes)) >= 0;
+}
+
 #define CONFIG_VALID_STR(config, t, v, invalid)		\
     do { if (!t(config->v)) { WARN("%s value '%s' invalid", #v, config->v); invalid++; } } while (0)
 
@@ -200,6 +288,19 @@ static int config_valid_options(config_t * config)
     CONFIG_VALID_NUM(config, is_valid_buffer_size, server_socket_rcvbuf_bytes, invalid);
     CONFIG_VALID_NUM(config, is_valid_buffer_size, server_socket_sndbuf_bytes, invalid);
     CONFIG_VALID_NUM(config, is_valid_millisec, max_socket_open_wait_millisec, invalid);
+    CONFIG_VALID_NUM(config, is_valid_listener_threads, listener_threads, invalid);
+    CONFIG_VALID_NUM(config, is_valid_udp_recv_batch, udp_recv_batch, invalid);
+    CONFIG_VALID_NUM(config, is_valid_tcp_send_batch, tcp_send_batch, invalid);
+    CONFIG_VALID_NUM(config, is_valid_shm_ring_bytes, shm_ring_bytes, invalid);
+    CONFIG_VALID_NUM(config, is_valid_fanout_log_slots, fanout_log_slots, invalid);
+    CONFIG_VALID_NUM(config, is_valid_listener_filter_bytes, listener_filter_min_bytes, invalid);
+    CONFIG_VALID_NUM(config, is_valid_listener_filter_bytes, listener_filter_max_bytes, invalid);
+    CONFIG_VALID_STR(config, is_valid_listener_filter_prefix, listener_filter_prefix, invalid);
+    if (config->listener_filter_max_bytes && config->listener_filter_min_bytes > config->listener_filter_max_bytes) {
+        WARN("listener_filter_min_bytes %u more than listener_filter_max_bytes %u",
+             config->listener_filter_min_bytes, config->listener_filter_max_bytes);
+        invalid++;
+    }
 
     CONFIG_VALID_STR(config, is_non_empty_string, lock_file, invalid);
 
@@ -208,6 +309,11 @@ static int config_valid_options(config_t * config)
     CONFIG_VALID_DIRECTORY(config, spill_root, invalid);
     CONFIG_VALID_NUM(config, is_valid_millisec, spill_millisec, invalid);
     CONFIG_VALID_NUM(config, is_valid_millisec, spill_grace_millisec, invalid);
+    CONFIG_VALID_STR(config, is_valid_memory_budget_policy, memory_budget_policy, invalid);
+    CONFIG_VALID_NUM(config, is_valid_millisec, memory_budget_shed_millisec, invalid);
+    CONFIG_VALID_STR(config, is_valid_worker_queue_policy, worker_queue_policy, invalid);
+    CONFIG_VALID_NUM(config, is_valid_worker_spin_usec, worker_spin_usec, invalid);
+    CONFIG_VALID_NUM(config, is_valid_millisec, worker_park_millisec, invalid);
 
     CONFIG_VALID_SOCKETIZE(config, IPPROTO_TCP, RELAY_CONN_IS_OUTBOUND, "graphite worker", graphite.dest_addr, invalid);
     CONFIG_VALID_STR(config, is_valid_graphite_target, graphite.path_root, invalid);
@@ -239,7 +345,20 @@ static int config_valid_addresses(config_t * config)
         invalid++;
     } else {
         for (int i = 1; i < config->argc; i++) {
-            CONFIG_VALID_SOCKETIZE(config, IPPROTO_TCP, RELAY_CONN_IS_OUTBOUND, "forward", argv[i], invalid);
+            size_t address_len;
+            worker_queue_limits_t limits;
+            if (!socket_worker_parse_arg(config->argv[i], config, &address_len, &limits)) {
+                WARN("argv[%d] value '%s' invalid", i, config->argv[i]);
+                invalid++;
+                continue;
+            }
+            char *address = strdup(config->argv[i]);
+            address[address_len] = '\0';
+            if (!is_valid_socketize(address, IPPROTO_TCP, RELAY_CONN_IS_OUTBOUND, "forward (config check)")) {
+                WARN("argv[%d] value '%s' invalid", i, config->argv[i]);
+                invalid++;
+            }
+            free(address);
         }
     }
 
@@ -292,7 +411,10 @@ static int config_from_line(config_t * config, const char *line, char *copy, cha
 
     if (*copy) {
         *opt = copy;
-        if ((p = strchr(copy, '='))) {
+        /* an option, unless the '=' is in the queue limits following
+         * a forward address, see socket_worker_parse_arg() */
+        p = copy + strcspn(copy, " \t=");
+        if (*p == '=') {
             if (p[1] == 0) {
                 SAY("Error in config file %s:%d: %s", file, *line_num, line);
                 return 0;
@@ -313,6 +435,17 @@ static int config_from_line(config_t * config, const char *line, char *copy, cha
                 TRY_NUM_OPT(server_socket_rcvbuf_bytes, copy, p);
                 TRY_NUM_OPT(server_socket_sndbuf_bytes, copy, p);
                 TRY_NUM_OPT(max_socket_open_wait_millisec, copy, p);
+                TRY_NUM_OPT(listener_threads, copy, p);
+                TRY_NUM_OPT(udp_recv_batch, copy, p);
+                TRY_NUM_OPT(tcp_send_batch, copy, p);
+                TRY_NUM_OPT(udp_gro, copy, p);
+                TRY_NUM_OPT(io_uring, copy, p);
+                TRY_NUM_OPT(shm_ring_bytes, copy, p);
+                TRY_NUM_OPT(fanout_log_slots, copy, p);
+                TRY_NUM_OPT(blob_pool, copy, p);
+                TRY_NUM_OPT(listener_filter_min_bytes, copy, p);
+                TRY_NUM_OPT(listener_filter_max_bytes, copy, p);
+                TRY_STR_OPT(listener_filter_prefix, copy, p);
 
                 TRY_STR_OPT(lock_file, copy, p);
 
@@ -324,6 +457,17 @@ static int config_from_line(config_t * config, const char *line, char *copy, cha
                 TRY_NUM_OPT(spill_millisec, copy, p);
                 TRY_NUM_OPT(spill_grace_millisec, copy, p);
 
+                TRY_NUM_OPT(memory_budget_mb, copy, p);
+                TRY_STR_OPT(memory_budget_policy, copy, p);
+                TRY_NUM_OPT(memory_budget_shed_millisec, copy, p);
+
+                TRY_NUM_OPT(worker_queue_max_items, copy, p);
+                TRY_NUM_OPT(worker_queue_max_bytes, copy, p);
+                TRY_STR_OPT(worker_queue_policy, copy, p);
+
+                TRY_NUM_OPT(worker_spin_usec, copy, p);
+                TRY_NUM_OPT(worker_park_millisec, copy, p);
+
                 TRY_STR_OPT(graphite.dest_addr, copy, p);
                 TRY_STR_OPT(graphite.path_root, copy, p);
                 TRY_NUM_OPT(graphite.add_ports, copy, p);
@@ -363,6 +507,17 @@ static int config_to_buffer(const config_t * config, fixed_buffer_t * buf)
     CONFIG_NUM_VCATF(server_socket_rcvbuf_bytes);
     CONFIG_NUM_VCATF(server_socket_sndbuf_bytes);
     CONFIG_NUM_VCATF(max_socket_open_wait_millisec);
+    CONFIG_NUM_VCATF(listener_threads);
+    CONFIG_NUM_VCATF(udp_recv_batch);
+    CONFIG_NUM_VCATF(tcp_send_batch);
+    CONFIG_NUM_VCATF(udp_gro);
+    CONFIG_NUM_VCATF(io_uring);
+    CONFIG_NUM_VCATF(shm_ring_bytes);
+    CONFIG_NUM_VCATF(fanout_log_slots);
+    CONFIG_NUM_VCATF(blob_pool);
+    CONFIG_NUM_VCATF(listener_filter_min_bytes);
+    CONFIG_NUM_VCATF(listener_filter_max_bytes);
+    CONFIG_STR_VCATF(listener_filter_prefix);
 
     CONFIG_STR_VCATF(lock_file);
 
@@ -374,6 +529,15 @@ static int config_to_buffer(const config_t * config, fixed_buffer_t * buf)
     CONFIG_NUM_VCATF(spill_millisec);
     CONFIG_NUM_VCATF(spill_grace_millisec);
 
+    CONFIG_NUM_VCATF(memory_budget_mb);
+    CONFIG_STR_VCATF(memory_budget_policy);
+    CONFIG_NUM_VCATF(memory_budget_shed_millisec);
+    CONFIG_NUM_VCATF(worker_queue_max_items);
+    CONFIG_NUM_VCATF(worker_queue_max_bytes);
+    CONFIG_STR_VCATF(worker_queue_policy);
+    CONFIG_NUM_VCATF(worker_spin_usec);
+    CONFIG_NUM_VCATF(worker_park_millisec);
+
     CONFIG_STR_VCATF(graphite.dest_addr);
     CONFIG_STR_VCATF(graphite.path_root);
     CONFIG_NUM_VCATF(graphite.add_ports);
@@ -637,6 +801,25 @@ int config_reload(config_t * config, const char *file, time_t now)
     IF_NUM_OPT_CHANGED(sleep_after_disaster_millisec, config, new_config);
     IF_NUM_OPT_CHANGED(server_socket_rcvbuf_bytes, config, new_config);
     IF_NUM_OPT_CHANGED(server_socket_sndbuf_bytes, config, new_config);
+    IF_NUM_OPT_CHANGED(listener_threads, config, new_config);
+    IF_NUM_OPT_CHANGED(udp_recv_batch, config, new_config);
+    IF_NUM_OPT_CHANGED(tcp_send_batch, config, new_config);
+    IF_NUM_OPT_CHANGED(udp_gro, config, new_config);
+    IF_NUM_OPT_CHANGED(io_uring, config, new_config);
+    IF_NUM_OPT_CHANGED(shm_ring_bytes, config, new_config);
+    if (control_is(RELAY_STARTING)) {
+        IF_NUM_OPT_CHANGED(fanout_log_slots, config, new_config);
+    } else if (config->fanout_log_slots != new_config->fanout_log_slots) {
+        WARN("Changing fanout_log_slots has no effect (has effect only on startup)");
+    }
+    if (control_is(RELAY_STARTING)) {
+        IF_NUM_OPT_CHANGED(blob_pool, config, new_config);
+    } else if (config->blob_pool != new_config->blob_pool) {
+        WARN("Changing blob_pool has no effect (has effect only on startup)");
+    }
+    IF_NUM_OPT_CHANGED(listener_filter_min_bytes, config, new_config);
+    IF_NUM_OPT_CHANGED(listener_filter_max_bytes, config, new_config);
+    IF_STR_OPT_CHANGED(listener_filter_prefix, config, new_config);
 
     if (control_is(RELAY_STARTING)) {
         IF_STR_OPT_CHANGED(lock_file, config, new_config);
@@ -652,6 +835,17 @@ int config_reload(config_t * config, const char *file, time_t now)
     IF_NUM_OPT_CHANGED(spill_millisec, config, new_config);
     IF_NUM_OPT_CHANGED(spill_grace_millisec, config, new_config);
 
+    IF_NUM_OPT_CHANGED(memory_budget_mb, config, new_config);
+    IF_STR_OPT_CHANGED(memory_budget_policy, config, new_config);
+    IF_NUM_OPT_CHANGED(memory_budget_shed_millisec, config, new_config);
+
+    IF_NUM_OPT_CHANGED(worker_queue_max_items, config, new_config);
+    IF_NUM_OPT_CHANGED(worker_queue_max_bytes, config, new_config);
+    IF_STR_OPT_CHANGED(worker_queue_policy, config, new_config);
+
+    IF_NUM_OPT_CHANGED(worker_spin_usec, config, new_config);
+    IF_NUM_OPT_CHANGED(worker_park_millisec, config, new_config);
+
     IF_STR_OPT_CHANGED(graphite.dest_addr, config, new_config);
     IF_STR_OPT_CHANGED(graphite.path_root, config, new_config);
     IF_NUM_OPT_CHANGED(graphite.add_ports, config, new_config);
@@ -99,6 +99,47 @@ struct config {
     uint32_t server_socket_rcvbuf_bytes;
     uint32_t server_socket_sndbuf_bytes;
 
+    /* the number of listener threads (udp receivers or tcp reactors),
+     * each with its own SO_REUSEPORT socket bound to the listener address */
+    uint32_t listener_threads;
+
+    /* the maximum number of datagrams the udp listener pulls in
+     * with a single recvmmsg() call, 1 means plain recv() */
+    uint32_t udp_recv_batch;
+
+    /* the maximum number of blobs a socket worker sends to a tcp
+     * destination with a single sendmsg() call */
+    uint32_t tcp_send_batch;
+
+    /* if non-zero, ask the kernel to coalesce incoming datagrams
+     * (UDP_GRO), the listener splits them up again */
+    int udp_gro;
+
+    /* if non-zero, use io_uring for the udp listener, the udp sends,
+     * and the spill writes, if the relay was built with it and the
+     * kernel supports it; otherwise the plain system calls are used */
+    int io_uring;
+
+    /* the size of the shared memory ring of a shm@/name listener,
+     * a power of two */
+    uint32_t shm_ring_bytes;
+
+    /* if non-zero, the workers read the blobs from a shared log of this
+     * many slots (a power of two) instead of each getting clones of them */
+    uint32_t fanout_log_slots;
+
+    /* if non-zero, the blobs come from the relay's own slab allocator
+     * (see blob_pool.h) instead of malloc() */
+    int blob_pool;
+
+    /* a socket filter on a datagram listener drops in the kernel the
+     * datagrams shorter than listener_filter_min_bytes or longer than
+     * listener_filter_max_bytes (zero meaning no limit), or not starting
+     * with the bytes of listener_filter_prefix (hex, empty meaning none) */
+    uint32_t listener_filter_min_bytes;
+    uint32_t listener_filter_max_bytes;
+    char *listener_filter_prefix;
+
     /* if disabled, we will just drop packets
      * we cannot send out in time (spill_millisec,
      * see also spill_grace_millisec)
@@ -117,6 +158,27 @@ struct config {
      * not present, but once this much has passed, the spill/drop engages. */
     uint32_t spill_grace_millisec;
 
+    /* the most memory the blobs may use (zero meaning no limit), and
+     * what to do beyond it: spill, drop_oldest, drop_newest or pause,
+     * see memory_budget.h */
+    uint32_t memory_budget_mb;
+    char *memory_budget_policy;
+    /* over the budget, spill or drop the blobs older than this */
+    uint32_t memory_budget_shed_millisec;
+
+    /* the most blobs, and payload bytes, queued for a single destination
+     * (zero meaning no limit), and what to do beyond them: spill (to the
+     * disk writer of the destination), drop_oldest or drop_newest */
+    uint32_t worker_queue_max_items;
+    uint32_t worker_queue_max_bytes;
+    char *worker_queue_policy;
+
+    /* with nothing to do, the socket workers and the disk writers poll
+     * their queues this long (zero for not at all), and then park until
+     * something is queued, but at most worker_park_millisec */
+    uint32_t worker_spin_usec;
+    uint32_t worker_park_millisec;
+
     struct graphite_config graphite;
 };
 
@@ -150,6 +212,53 @@ typedef struct config config_t;
 #define DEFAULT_SERVER_SOCKET_SNDBUF_BYTES (32 * 1024 * 1024)
 #endif
 
+#ifndef DEFAULT_LISTENER_THREADS
+#define DEFAULT_LISTENER_THREADS 1
+#endif
+
+#ifndef DEFAULT_UDP_RECV_BATCH
+#define DEFAULT_UDP_RECV_BATCH 32
+#endif
+
+#ifndef DEFAULT_TCP_SEND_BATCH
+#define DEFAULT_TCP_SEND_BATCH 64
+#endif
+
+#ifndef DEFAULT_UDP_GRO
+#define DEFAULT_UDP_GRO 0
+#endif
+
+#ifndef DEFAULT_IO_URING
+#define DEFAULT_IO_URING 0
+#endif
+
+#ifndef DEFAULT_LISTENER_FILTER_MIN_BYTES
+#define DEFAULT_LISTENER_FILTER_MIN_BYTES 0
+#endif
+
+#ifndef DEFAULT_LISTENER_FILTER_MAX_BYTES
+#define DEFAULT_LISTENER_FILTER_MAX_BYTES 0
+#endif
+
+#ifndef DEFAULT_LISTENER_FILTER_PREFIX
+#define DEFAULT_LISTENER_FILTER_PREFIX ""
+#endif
+
+/* The longest listener_filter_prefix, in bytes. */
+#define MAX_LISTENER_FILTER_PREFIX 16
+
+#ifndef DEFAULT_SHM_RING_BYTES
+#define DEFAULT_SHM_RING_BYTES (16 * 1024 * 1024)
+#endif
+
+#ifndef DEFAULT_FANOUT_LOG_SLOTS
+#define DEFAULT_FANOUT_LOG_SLOTS 0
+#endif
+
+#ifndef DEFAULT_BLOB_POOL
+#define DEFAULT_BLOB_POOL 0
+#endif
+
 #ifndef DEFAULT_SLEEP_AFTER_DISASTER_MILLISEC
 #define DEFAULT_SLEEP_AFTER_DISASTER_MILLISEC 100
 #endif
@@ -182,6 +291,38 @@ typedef struct config config_t;
 #define DEFAULT_SPILL_GRACE_MILLISEC (20 * 1000)
 #endif
 
+#ifndef DEFAULT_MEMORY_BUDGET_MB
+#define DEFAULT_MEMORY_BUDGET_MB 0
+#endif
+
+#ifndef DEFAULT_MEMORY_BUDGET_POLICY
+#define DEFAULT_MEMORY_BUDGET_POLICY "spill"
+#endif
+
+#ifndef DEFAULT_MEMORY_BUDGET_SHED_MILLISEC
+#define DEFAULT_MEMORY_BUDGET_SHED_MILLISEC 100
+#endif
+
+#ifndef DEFAULT_WORKER_QUEUE_MAX_ITEMS
+#define DEFAULT_WORKER_QUEUE_MAX_ITEMS 0
+#endif
+
+#ifndef DEFAULT_WORKER_QUEUE_MAX_BYTES
+#define DEFAULT_WORKER_QUEUE_MAX_BYTES 0
+#endif
+
+#ifndef DEFAULT_WORKER_QUEUE_POLICY
+#define DEFAULT_WORKER_QUEUE_POLICY "spill"
+#endif
+
+#ifndef DEFAULT_WORKER_SPIN_USEC
+#define DEFAULT_WORKER_SPIN_USEC 0
+#endif
+
+#ifndef DEFAULT_WORKER_PARK_MILLISEC
+#define DEFAULT_WORKER_PARK_MILLISEC 100
+#endif
+
 #ifndef DEFAULT_SPILL_ROOT
 #define DEFAULT_SPILL_ROOT "/var/tmp/event-relay/spill"
 #endif
@@ -6,6 +6,7 @@
 #include "global.h"
 #include "log.h"
 #include "socket_worker_pool.h"
+#include "timer.h"
 
 /* create a directory with the right permissions
  */
@@ -79,7 +80,7 @@ static int write_blob_to_disk(disk_writer_t * self, blob_t * b)
         return 0;
     }
 
-    if (!setup_for_epoch(self, BLOB_RECEIVED_TIME(b).tv_sec))
+    if (!setup_for_epoch(self, wall_time_sec(&BLOB_RECEIVED_TIME(b))))
         return 0;
 
     const config_t *config = self->base.config;
@@ -107,6 +108,84 @@ static int write_blob_to_disk(disk_writer_t * self, blob_t * b)
 }
 
 
+#ifdef HAVE_IO_URING
+/* The most blobs submitted to the io_uring at a time. */
+#define URING_WRITE_BATCH 32
+
+/* Write the blobs at the head of the queue that belong to the same
+ * epoch, up to URING_WRITE_BATCH of them, with one io_uring submission.
+ * The writes are linked so that they append in order.  The written blobs
+ * are destroyed.  Returns the number written, or -1 on failure. */
+static int uring_write_blobs_to_disk(disk_writer_t * self, queue_t * private_queue)
+{
+    queue_cursor_t cursor;
+    blob_t *b = queue_cursor_start(&cursor, private_queue);
+    blob_t *batch[URING_WRITE_BATCH];
+    time_t blob_epoch = wall_time_sec(&BLOB_RECEIVED_TIME(b));
+
+    if (!setup_for_epoch(self, blob_epoch))
+        return -1;
+
+    if (self->fd < 0) {
+        RELAY_ATOMIC_INCREMENT(self->counters->disk_error_count, 1);
+        return -1;
+    }
+
+    struct io_uring_sqe *prev = NULL;
+    int n = 0;
+    for (; b && n < URING_WRITE_BATCH && wall_time_sec(&BLOB_RECEIVED_TIME(b)) == blob_epoch;
+         b = queue_cursor_next(&cursor)) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+        if (!sqe)
+            break;
+        if (prev)
+            prev->flags |= IOSQE_IO_LINK;
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = self->fd;
+        sqe->addr = (uint64_t) (uintptr_t) BLOB_BUF(b);
+        sqe->len = BLOB_BUF_SIZE(b);
+        /* The current file position, which O_APPEND keeps at the end. */
+        sqe->off = (uint64_t) - 1;
+        sqe->user_data = n;
+        prev = sqe;
+        batch[n++] = b;
+    }
+
+    int completed = 0;
+    int failed = 0;
+    while (completed < n) {
+        if (uring_submit_and_wait(&self->ring, n - completed, 0) < 0 && errno != EINTR) {
+            FATAL_ERRNO("io_uring_enter failed for '%s'", self->last_file_path);
+            return -1;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&self->ring))) {
+            blob_t *written = cqe->user_data < (uint64_t) n ? batch[cqe->user_data] : NULL;
+            /* A failed or short write cancels the rest of the chain. */
+            if (!written || cqe->res != (int) BLOB_BUF_SIZE(written)) {
+                if (!failed) {
+                    errno = cqe->res < 0 ? -cqe->res : 0;
+                    FATAL_ERRNO("write '%s' failed: wrote %d tried %d bytes:", self->last_file_path,
+                                cqe->res, written ? BLOB_BUF_SIZE(written) : 0);
+                }
+                failed = 1;
+            }
+            uring_cqe_seen(&self->ring);
+            completed++;
+        }
+    }
+
+    if (failed)
+        return -1;
+
+    for (int i = 0; i < n; i++)
+        blob_destroy(queue_shift_nolock(private_queue));
+    RELAY_ATOMIC_INCREMENT(self->counters->disk_count, n);
+
+    return n;
+}
+#endif                          /* #ifdef HAVE_IO_URING */
+
 /* create a disk writer worker thread
  * main loop for the disk writer worker process */
 void *disk_writer_thread(void *arg)
@@ -123,16 +202,25 @@ void *disk_writer_thread(void *arg)
     SAY("Disk spill is %s", config->spill_enabled ? "enabled" : "DISABLED");
 
     queue_t private_queue;
-    queue_t *main_queue = &self->queue;
+    mpsc_queue_t *main_queue = &self->queue;
     blob_t *b;
     uint32_t done_work = 0;
 
     memset(&private_queue, 0, sizeof(private_queue));
 
+#ifdef HAVE_IO_URING
+    int uring_opened = config->io_uring;
+    if (uring_opened) {
+        self->uring_ready = uring_init(&self->ring, 2 * URING_WRITE_BATCH);
+        if (!self->uring_ready)
+            WARN_ERRNO("io_uring setup failed, not using io_uring");
+    }
+#endif
+
     while (1) {
 
-        queue_hijack(main_queue, &private_queue, &GLOBAL.pool.lock);
-        b = private_queue.head;
+        mpsc_queue_hijack(main_queue, &private_queue);
+        b = queue_peek(&private_queue);
 
         if (b == NULL) {
             if (done_work) {
@@ -144,14 +232,39 @@ void *disk_writer_thread(void *arg)
 
             setup_for_epoch(self, 0);
             if (RELAY_ATOMIC_READ(self->base.stopping)) {
+                /* the socket worker spills what it had left right before
+                 * asking us to exit, so look once more */
+                if (mpsc_queue_hijack(main_queue, &private_queue))
+                    continue;
                 /* nothing to do and we have been asked to exit, so break from the loop */
                 break;
             } else {
-                worker_wait_millisec(config->polling_interval_millisec);
+                mpsc_queue_park(main_queue, config->worker_spin_usec, config->worker_park_millisec, NULL, 0);
             }
         } else {
             int failed = 0;
 
+#ifdef HAVE_IO_URING
+            if (self->uring_ready && config->spill_enabled) {
+                do {
+                    int wrote = uring_write_blobs_to_disk(self, &private_queue);
+                    if (wrote < 0) {
+                        FATAL("Failed to write blob to disk");
+                        failed = 1;
+                        break;
+                    }
+                    done_work += wrote;
+                }
+                while (private_queue.head != NULL);
+
+                accumulate_and_clear_stats(self->counters, self->recents, self->totals);
+
+                if (failed)
+                    break;
+                continue;
+            }
+#endif
+
             do {
                 done_work++;
                 if (config->spill_enabled && !write_blob_to_disk(self, b)) {
@@ -161,7 +274,7 @@ void *disk_writer_thread(void *arg)
                 }
                 blob_destroy(queue_shift_nolock(&private_queue));
             }
-            while (!failed && (b = private_queue.head) != NULL);
+            while (!failed && (b = queue_peek(&private_queue)) != NULL);
 
             accumulate_and_clear_stats(self->counters, self->recents, self->totals);
 
@@ -173,8 +286,8 @@ void *disk_writer_thread(void *arg)
     if (control_is(RELAY_STOPPING)) {
         if (config->spill_enabled) {
             SAY("Disk writer stopping, trying disk flush");
-            queue_hijack(main_queue, &private_queue, &GLOBAL.pool.lock);
-            b = private_queue.head;
+            mpsc_queue_hijack(main_queue, &private_queue);
+            b = queue_peek(&private_queue);
             size_t wrote = 0;
             if (b) {
                 SAY("Disk flush starting");
@@ -183,7 +296,7 @@ void *disk_writer_thread(void *arg)
                     wrote += b->ref->data.size;
                     blob_destroy(queue_shift_nolock(&private_queue));
                 }
-                while ((b = private_queue.head) != NULL);
+                while ((b = queue_peek(&private_queue)) != NULL);
             } else {
                 SAY("Nothing to disk flush");
             }
@@ -195,6 +308,12 @@ void *disk_writer_thread(void *arg)
 
     accumulate_and_clear_stats(self->counters, self->recents, self->totals);
 
+#ifdef HAVE_IO_URING
+    if (uring_opened)
+        uring_close(&self->ring);
+    self->uring_ready = 0;
+#endif
+
     SAY("disk_writer saved %lu packets in its lifetime", (unsigned long) self->totals->disk_count);
 
     return NULL;
@@ -6,13 +6,14 @@
 #include "blob.h"
 #include "relay_common.h"
 #include "stats.h"
+#include "uring.h"
 #include "worker_base.h"
 
 /* disk worker thread */
 struct disk_writer {
     struct worker_base base;
 
-    queue_t queue;
+    mpsc_queue_t queue;
 
     /* These are pointing back to the socket worker's counters. */
     stats_basic_counters_t *counters;
@@ -27,6 +28,12 @@ struct disk_writer {
     time_t last_epoch;
 
     int fd;
+
+#ifdef HAVE_IO_URING
+    /* If uring_ready, the blobs are written through the ring. */
+    uring_t ring;
+    int uring_ready;
+#endif
 };
 typedef struct disk_writer disk_writer_t;
 
@@ -0,0 +1,158 @@
+#include "fanout_log.h"
+
+#include <sched.h>
+#include <string.h>
+
+#include "log.h"
+#include "relay_common.h"
+
+#define FANOUT_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define FANOUT_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+fanout_log_t *fanout_log_create(uint32_t n_slots)
+{
+    fanout_log_t *log = calloc_or_fatal(sizeof(fanout_log_t));
+
+    log->slots = calloc_or_fatal(n_slots * sizeof(blob_t *));
+    log->mask = n_slots - 1;
+    LOCK_INIT(&log->lock);
+
+    return log;
+}
+
+/* Free the slots every reader is done with.  Called with the lock held. */
+static void fanout_log_reclaim(fanout_log_t * log)
+{
+    uint64_t published = FANOUT_LOAD_ACQUIRE(&log->published);
+    uint64_t seq;
+
+    for (seq = log->reclaimed; seq < published; seq++) {
+        for (fanout_reader_t * r = log->readers; r; r = r->next) {
+            /* The nodes are filled in before the read cursor is moved. */
+            if (seq >= FANOUT_LOAD_ACQUIRE(&r->read) || FANOUT_LOAD_ACQUIRE(&r->nodes[seq & log->mask].ref))
+                goto done;
+        }
+        blob_t *b = log->slots[seq & log->mask];
+        BLOB_REFCNT_set(b, 1);
+        blob_destroy(b);
+    }
+
+  done:
+    FANOUT_STORE_RELEASE(&log->reclaimed, seq);
+}
+
+/* Reclaim, unless someone else already is. */
+static void fanout_log_try_reclaim(fanout_log_t * log)
+{
+    if (pthread_mutex_trylock(&log->lock) == 0) {
+        fanout_log_reclaim(log);
+        UNLOCK(&log->lock);
+    }
+}
+
+void fanout_log_destroy(fanout_log_t * log)
+{
+    if (log->readers)
+        WARN("fanout log destroyed with readers left");
+
+    for (uint64_t seq = log->reclaimed; seq < log->published; seq++) {
+        blob_t *b = log->slots[seq & log->mask];
+        BLOB_REFCNT_set(b, 1);
+        blob_destroy(b);
+    }
+
+    LOCK_DESTROY(&log->lock);
+    free(log->slots);
+    free(log);
+}
+
+fanout_reader_t *fanout_log_reader_add(fanout_log_t * log)
+{
+    fanout_reader_t *reader = calloc_or_fatal(sizeof(fanout_reader_t));
+
+    reader->nodes = calloc_or_fatal((log->mask + 1) * sizeof(blob_t));
+
+    LOCK(&log->lock);
+    reader->read = FANOUT_LOAD_ACQUIRE(&log->published);
+    reader->next = log->readers;
+    log->readers = reader;
+    UNLOCK(&log->lock);
+
+    return reader;
+}
+
+/* The reader must have released all of its nodes. */
+void fanout_log_reader_remove(fanout_log_t * log, fanout_reader_t * reader)
+{
+    LOCK(&log->lock);
+    for (fanout_reader_t ** p = &log->readers; *p; p = &(*p)->next) {
+        if (*p == reader) {
+            *p = reader->next;
+            break;
+        }
+    }
+    fanout_log_reclaim(log);
+    UNLOCK(&log->lock);
+
+    free(reader->nodes);
+    free(reader);
+}
+
+int fanout_log_append(fanout_log_t * log, queue_t * batch)
+{
+    uint64_t n = batch->count;
+    uint64_t claimed;
+
+    if (n == 0)
+        return 1;
+
+    do {
+        claimed = log->claimed;
+        if (claimed + n - FANOUT_LOAD_ACQUIRE(&log->reclaimed) > log->mask + 1) {
+            fanout_log_try_reclaim(log);
+            if (claimed + n - FANOUT_LOAD_ACQUIRE(&log->reclaimed) > log->mask + 1)
+                return 0;
+        }
+    } while (!RELAY_ATOMIC_CMPXCHG(log->claimed, claimed, claimed + n));
+
+    uint64_t seq = claimed;
+    queue_cursor_t cursor;
+    for (blob_t * b = queue_cursor_start(&cursor, batch); b; b = queue_cursor_next(&cursor)) {
+        BLOB_REFCNT_set(b, BLOB_REFCNT_LOGGED);
+        log->slots[seq++ & log->mask] = b;
+    }
+    queue_clear_nolock(batch);
+
+    /* The writers that claimed before us have to publish first,
+     * they are only storing a few pointers. */
+    while (FANOUT_LOAD_ACQUIRE(&log->published) != claimed)
+        sched_yield();
+    FANOUT_STORE_RELEASE(&log->published, claimed + n);
+
+    fanout_log_try_reclaim(log);
+
+    return 1;
+}
+
+uint32_t fanout_log_hijack(fanout_log_t * log, fanout_reader_t * reader, queue_t * q)
+{
+    uint64_t seq;
+
+    /* Also here, so that an idle relay does not keep the blobs around. */
+    fanout_log_try_reclaim(log);
+
+    uint64_t published = FANOUT_LOAD_ACQUIRE(&log->published);
+
+    /* The slots are reclaimed only once our nodes have been released,
+     * so the nodes are free to be reused here. */
+    for (seq = reader->read; seq < published; seq++) {
+        blob_t *node = &reader->nodes[seq & log->mask];
+        BLOB_REF_PTR_set(node, BLOB_REF_PTR(log->slots[seq & log->mask]));
+        queue_append_nolock(q, node);
+    }
+
+    uint32_t count = published - reader->read;
+    FANOUT_STORE_RELEASE(&reader->read, published);
+
+    return count;
+}
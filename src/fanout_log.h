@@ -0,0 +1,66 @@
+#ifndef RELAY_FANOUT_LOG_H
+#define RELAY_FANOUT_LOG_H
+
+/* An alternative fan-out to the workers (fanout_log_slots): instead of
+ * every worker getting a clone of every blob in its own queue, the blobs
+ * are appended once to a shared ring of slots, and every worker reads
+ * them from there with a cursor of its own.
+ *
+ * A reader links the blobs into its private queue through queue nodes
+ * of its own, one per slot, allocated once: so the fan-out costs no
+ * allocations, and no refcount updates either.  blob_destroy() of such
+ * a node just releases it, and a slot is reclaimed (the blob freed) once
+ * every reader has read past it and released its node, be it after the
+ * sending or after the spilling.
+ *
+ * The writers claim their slots with a compare-and-swap, and publish
+ * them in the claim order.  If the slowest reader keeps the ring full
+ * the append fails, and the caller falls back to the cloning.  To keep
+ * the order, the readers take the log before their queue of clones, and
+ * the log is used again only once all the clones have been taken. */
+
+#include "blob.h"
+#include "relay_threads.h"
+
+struct fanout_reader {
+    /* The sequence number of the next slot to read. */
+    volatile uint64_t read;
+    /* The queue node of each slot, its ref cleared once released. */
+    blob_t *nodes;
+    struct fanout_reader *next;
+};
+typedef struct fanout_reader fanout_reader_t;
+
+struct fanout_log {
+    blob_t **slots;
+    uint64_t mask;
+
+    /* The slots below claimed are taken by the writers, the ones below
+     * published can be read, and the ones below reclaimed are free. */
+    volatile uint64_t claimed;
+    volatile uint64_t published;
+    volatile uint64_t reclaimed;
+
+    /* Held to change the readers, and to reclaim. */
+    LOCK_T lock;
+    fanout_reader_t *readers;
+};
+typedef struct fanout_log fanout_log_t;
+
+/* The number of slots must be a power of two. */
+fanout_log_t *fanout_log_create(uint32_t n_slots);
+void fanout_log_destroy(fanout_log_t * log);
+
+/* A new reader starts reading from the slots published after it was added. */
+fanout_reader_t *fanout_log_reader_add(fanout_log_t * log);
+void fanout_log_reader_remove(fanout_log_t * log, fanout_reader_t * reader);
+
+/* Appends all of the batch, emptying it.  Returns 0 if there was no room,
+ * in which case the batch is left as it was. */
+int fanout_log_append(fanout_log_t * log, queue_t * batch);
+
+/* Appends the published blobs the reader has not read yet to a queue,
+ * returns their number. */
+uint32_t fanout_log_hijack(fanout_log_t * log, fanout_reader_t * reader, queue_t * q);
+
+#endif                          /* #ifndef RELAY_FANOUT_LOG_H */
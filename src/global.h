@@ -3,6 +3,8 @@
 
 #include "config.h"
 #include "graphite_worker.h"
+#include "memory_budget.h"
+#include "relay.h"
 #include "socket_worker_pool.h"
 
 struct relay_global {
@@ -10,17 +12,13 @@ struct relay_global {
     volatile int exit_code;
     config_t *config;
     relay_socket_t *listener;
+    listener_t listeners[MAX_LISTENER_THREADS];
+    volatile uint32_t n_listeners;
     graphite_worker_t *graphite_worker;
     socket_worker_pool_t pool;
 
-    int64_t blob_active_count;
-    int64_t blob_active_bytes;
-    int64_t blob_active_refcnt_bytes;
-    int64_t blob_total_count;
-    int64_t blob_total_bytes;
-    int64_t blob_total_refcnt_bytes;
-    int64_t blob_total_sizes[32];       /* ceil(log2(size)) buckets */
-    int64_t blob_total_ored_buckets;    /* OR of all the seen bucket indices */
+    blob_stats_t blob_stats[BLOB_STATS_SLOTS];
+    memory_budget_t budget;
 };
 typedef struct relay_global relay_global_t;
 
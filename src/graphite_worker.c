@@ -6,8 +6,10 @@
 
 #include <inttypes.h>
 
+#include "blob_pool.h"
 #include "global.h"
 #include "log.h"
+#include "relay.h"
 #include "relay_threads.h"
 #include "socket_worker_pool.h"
 #include "string_util.h"
@@ -133,6 +135,8 @@ static int graphite_build_worker(graphite_worker_t * self, socket_worker_t * w,
         STATS_LOADAVG_VCATF(sent, 1, 5);
         STATS_LOADAVG_VCATF(sent, 2, 15);
 
+        STATS_VCATF(send_call);
+
         STATS_VCATF(partial);
 
         STATS_VCATF(spilled);
@@ -150,6 +154,14 @@ static int graphite_build_worker(graphite_worker_t * self, socket_worker_t * w,
         STATS_VCATF(error);
         STATS_VCATF(disk);
         STATS_VCATF(disk_error);
+
+        /* what is waiting for the destination right now */
+        if (!fixed_buffer_vcatf(buffer, stats_format, "queue.count", (long) RELAY_ATOMIC_READ(w->queued_count)))
+            return 0;
+        if (!fixed_buffer_vcatf(buffer, stats_format, "queue.bytes", (long) RELAY_ATOMIC_READ(w->queued_bytes)))
+            return 0;
+        if (!fixed_buffer_vcatf(buffer, stats_format, "diverted", (long) w->diverted))
+            return 0;
     } while (0);
     if (buffer->used >= buffer->size)
         return 0;
@@ -170,7 +182,7 @@ static int graphite_build(graphite_worker_t * self, fixed_buffer_t * buffer, tim
      * don't want to hold the POOL lock for the duration of the sendto() call.
      */
 
-    LOCK(&GLOBAL.pool.lock);
+    RDLOCK(&GLOBAL.pool.lock);
 
     fixed_buffer_reset(buffer);
 
@@ -183,9 +195,12 @@ static int graphite_build(graphite_worker_t * self, fixed_buffer_t * buffer, tim
             break;
         }
     }
-    UNLOCK(&GLOBAL.pool.lock);
+    RWUNLOCK(&GLOBAL.pool.lock);
 
     {
+        blob_stats_t blobs;
+        blob_stats_sum(&blobs);
+
         char blobs_format[256];
         int wrote = snprintf(blobs_format, sizeof(blobs_format), "%s.blobs.%%s %%ld %lu\n", self->path_root->data,
                              this_epoch);
@@ -194,16 +209,16 @@ static int graphite_build(graphite_worker_t * self, fixed_buffer_t * buffer, tim
             return 0;
         }
 
-        fixed_buffer_vcatf(buffer, blobs_format, "active_count", RELAY_ATOMIC_READ(GLOBAL.blob_active_count));
-        fixed_buffer_vcatf(buffer, blobs_format, "active.bytes", RELAY_ATOMIC_READ(GLOBAL.blob_active_bytes));
-        fixed_buffer_vcatf(buffer, blobs_format, "active_refcnt.bytes",
-                           RELAY_ATOMIC_READ(GLOBAL.blob_active_refcnt_bytes));
-        fixed_buffer_vcatf(buffer, blobs_format, "total.count", RELAY_ATOMIC_READ(GLOBAL.blob_total_count));
-        fixed_buffer_vcatf(buffer, blobs_format, "total.bytes", RELAY_ATOMIC_READ(GLOBAL.blob_total_bytes));
-        fixed_buffer_vcatf(buffer, blobs_format, "total_refcnt.bytes",
-                           RELAY_ATOMIC_READ(GLOBAL.blob_total_refcnt_bytes));
+        fixed_buffer_vcatf(buffer, blobs_format, "active_count", blobs.active_count);
+        fixed_buffer_vcatf(buffer, blobs_format, "active.bytes", blobs.active_bytes);
+        fixed_buffer_vcatf(buffer, blobs_format, "active_refcnt.bytes", blobs.active_refcnt_bytes);
+        fixed_buffer_vcatf(buffer, blobs_format, "total.count", blobs.total_count);
+        fixed_buffer_vcatf(buffer, blobs_format, "total.bytes", blobs.total_bytes);
+        fixed_buffer_vcatf(buffer, blobs_format, "total_refcnt.bytes", blobs.total_refcnt_bytes);
+        if (blob_pool_enabled())
+            fixed_buffer_vcatf(buffer, blobs_format, "pool.slab.bytes", blob_pool_slab_bytes());
 
-        int64_t buckets = RELAY_ATOMIC_READ(GLOBAL.blob_total_ored_buckets);
+        int64_t buckets = blobs.total_ored_buckets;
 
         if (buckets) {
             char buckets_format[256];
@@ -216,9 +231,9 @@ static int graphite_build(graphite_worker_t * self, fixed_buffer_t * buffer, tim
             }
 
             for (int i = 0;
-                 buckets && i < (int) sizeof(GLOBAL.blob_total_sizes) / (int) sizeof(GLOBAL.blob_total_sizes[0]);
+                 buckets && i < (int) sizeof(blobs.total_sizes) / (int) sizeof(blobs.total_sizes[0]);
                  i++, buckets >>= 1) {
-                int64_t count = RELAY_ATOMIC_READ(GLOBAL.blob_total_sizes[i]);
+                int64_t count = blobs.total_sizes[i];
                 if (count > 0) {
                     fixed_buffer_vcatf(buffer, buckets_format, i, count);
                 }
@@ -226,6 +241,89 @@ static int graphite_build(graphite_worker_t * self, fixed_buffer_t * buffer, tim
         }
     }
 
+    {
+        /* The usage and the limit as they are, what the policy did since
+         * the previous build. */
+        memory_budget_t *budget = &GLOBAL.budget;
+        int64_t spilled = RELAY_ATOMIC_READ(budget->spilled_count);
+        int64_t dropped_oldest = RELAY_ATOMIC_READ(budget->dropped_oldest_count);
+        int64_t dropped_newest = RELAY_ATOMIC_READ(budget->dropped_newest_count);
+        int64_t paused = RELAY_ATOMIC_READ(budget->paused_count);
+
+        fixed_buffer_vcatf(buffer, "%s.budget.used.bytes %ld %lu\n", self->path_root->data,
+                           (long) budget->used_bytes, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.budget.limit.bytes %ld %lu\n", self->path_root->data,
+                           (long) budget->limit_bytes, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.budget.spilled.count %ld %lu\n", self->path_root->data,
+                           (long) (spilled - self->budget_prev.spilled_count), this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.budget.dropped_oldest.count %ld %lu\n", self->path_root->data,
+                           (long) (dropped_oldest - self->budget_prev.dropped_oldest_count), this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.budget.dropped_newest.count %ld %lu\n", self->path_root->data,
+                           (long) (dropped_newest - self->budget_prev.dropped_newest_count), this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.budget.paused.count %ld %lu\n", self->path_root->data,
+                           (long) (paused - self->budget_prev.paused_count), this_epoch);
+
+        self->budget_prev.spilled_count = spilled;
+        self->budget_prev.dropped_oldest_count = dropped_oldest;
+        self->budget_prev.dropped_newest_count = dropped_newest;
+        self->budget_prev.paused_count = paused;
+    }
+
+    {
+        /* The listener counters are running totals, so send the
+         * differences since the previous build. */
+        stats_basic_counters_t received;
+        listener_stats_sum(&received);
+
+        stats_count_t received_diff = received.received_count - self->received_prev.received_count;
+        stats_count_t recv_calls_diff = received.recv_call_count - self->received_prev.recv_call_count;
+        stats_count_t kernel_drops_diff = received.kernel_drops - self->received_prev.kernel_drops;
+        stats_count_t rxq_drops_diff = received.rxq_drops - self->received_prev.rxq_drops;
+        stats_count_t errors_diff = received.error_count - self->received_prev.error_count;
+
+        self->received_prev = received;
+
+        fixed_buffer_vcatf(buffer, "%s.listener.received.count %lu %lu\n", self->path_root->data,
+                           (unsigned long) received_diff, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.recv_calls.count %lu %lu\n", self->path_root->data,
+                           (unsigned long) recv_calls_diff, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.received_per_recv %.2f %lu\n", self->path_root->data,
+                           recv_calls_diff ? (double) received_diff / recv_calls_diff : 0.0, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.kernel_drops.count %lu %lu\n", self->path_root->data,
+                           (unsigned long) kernel_drops_diff, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.rxq_drops.count %lu %lu\n", self->path_root->data,
+                           (unsigned long) rxq_drops_diff, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.errors.count %lu %lu\n", self->path_root->data,
+                           (unsigned long) errors_diff, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.queue.bytes %lu %lu\n", self->path_root->data,
+                           (unsigned long) received.rxq_bytes, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.queue.peak_bytes %lu %lu\n", self->path_root->data,
+                           (unsigned long) listener_queue_peak(), this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.queue.rcvbuf_bytes %lu %lu\n", self->path_root->data,
+                           (unsigned long) received.rcvbuf_bytes, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.tcp_connections %lu %lu\n", self->path_root->data,
+                           (unsigned long) received.tcp_connections, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.tcp_buffers.in_use %lu %lu\n", self->path_root->data,
+                           (unsigned long) received.tcp_buffers_in_use, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.tcp_buffers.bytes %lu %lu\n", self->path_root->data,
+                           (unsigned long) received.tcp_buffer_bytes, this_epoch);
+        fixed_buffer_vcatf(buffer, "%s.listener.tcp_buffers.pooled %lu %lu\n", self->path_root->data,
+                           (unsigned long) received.tcp_buffers_pooled, this_epoch);
+
+        uint32_t n_listeners = RELAY_ATOMIC_READ(GLOBAL.n_listeners);
+        if (n_listeners > 1) {
+            for (uint32_t i = 0; i < n_listeners; i++) {
+                stats_basic_counters_t *counters = &GLOBAL.listeners[i].counters;
+                stats_count_t count = RELAY_ATOMIC_READ(counters->received_count);
+                fixed_buffer_vcatf(buffer, "%s.listener.thread_%u.received.count %lu %lu\n", self->path_root->data,
+                                   i, (unsigned long) (count - self->listener_received_prev[i]), this_epoch);
+                fixed_buffer_vcatf(buffer, "%s.listener.thread_%u.tcp_connections %lu %lu\n", self->path_root->data,
+                                   i, (unsigned long) RELAY_ATOMIC_READ(counters->tcp_connections), this_epoch);
+                self->listener_received_prev[i] = count;
+            }
+        }
+    }
+
 #ifdef HAVE_MALLINFO
     if (config->malloc.style == SYSTEM_MALLOC) {
         /* get memory details */
@@ -3,7 +3,10 @@
 
 #include <pthread.h>
 
+#include "memory_budget.h"
+#include "relay.h"
 #include "socket_util.h"
+#include "stats.h"
 #include "string_util.h"
 #include "worker_base.h"
 
@@ -15,6 +18,13 @@ struct graphite_worker {
     fixed_buffer_t *path_root;
 
     fixed_buffer_t *send_buffer;
+
+    /* The listener totals as of the previous build. */
+    stats_basic_counters_t received_prev;
+    stats_count_t listener_received_prev[MAX_LISTENER_THREADS];
+
+    /* The memory budget policy totals as of the previous build. */
+    memory_budget_t budget_prev;
 };
 
 typedef struct graphite_worker graphite_worker_t;
@@ -0,0 +1,128 @@
+#include "ingest.h"
+
+const uint32_t tcp_buffer_sizes[TCP_BUFFER_CLASSES] = { 4 * 1024, 16 * 1024 };
+
+/* Give the client a staging buffer of the given class from the pool,
+ * allocating a new one if the pool has none. */
+void tcp_buffer_get(tcp_server_context_t * ctxt, struct tcp_client *client, uint32_t buf_class)
+{
+    struct tcp_free_buffer *free_buffer = ctxt->free_buffers[buf_class];
+
+    if (free_buffer) {
+        ctxt->free_buffers[buf_class] = free_buffer->next;
+        ctxt->n_free_buffers[buf_class]--;
+        RELAY_ATOMIC_DECREMENT(ctxt->counters->tcp_buffers_pooled, 1);
+        client->buf = (unsigned char *) free_buffer;
+    } else {
+        client->buf = malloc_or_fatal(tcp_buffer_sizes[buf_class]);
+    }
+    client->buf_class = buf_class;
+
+    RELAY_ATOMIC_INCREMENT(ctxt->counters->tcp_buffers_in_use, 1);
+    RELAY_ATOMIC_INCREMENT(ctxt->counters->tcp_buffer_bytes, tcp_buffer_sizes[buf_class]);
+}
+
+/* Give the staging buffer of the client back to the pool, or free it
+ * if the pool is full. */
+void tcp_buffer_put(tcp_server_context_t * ctxt, struct tcp_client *client)
+{
+    uint32_t buf_class = client->buf_class;
+
+    RELAY_ATOMIC_DECREMENT(ctxt->counters->tcp_buffers_in_use, 1);
+    RELAY_ATOMIC_DECREMENT(ctxt->counters->tcp_buffer_bytes, tcp_buffer_sizes[buf_class]);
+
+    if (ctxt->n_free_buffers[buf_class] < TCP_BUFFER_POOL_MAX) {
+        struct tcp_free_buffer *free_buffer = (struct tcp_free_buffer *) client->buf;
+        free_buffer->next = ctxt->free_buffers[buf_class];
+        ctxt->free_buffers[buf_class] = free_buffer;
+        ctxt->n_free_buffers[buf_class]++;
+        RELAY_ATOMIC_INCREMENT(ctxt->counters->tcp_buffers_pooled, 1);
+    } else {
+        free(client->buf);
+    }
+    client->buf = NULL;
+    client->buf_class = TCP_BUFFER_SMALL;
+}
+
+/* Move the contents of a small staging buffer into a large one. */
+static void tcp_buffer_grow(tcp_server_context_t * ctxt, struct tcp_client *client)
+{
+    struct tcp_client small = *client;
+
+    tcp_buffer_get(ctxt, client, TCP_BUFFER_LARGE);
+    memcpy(client->buf, small.buf, client->pos);
+    tcp_buffer_put(ctxt, &small);
+}
+
+/* Release the free buffers of the pool. */
+void tcp_buffer_pool_close(tcp_server_context_t * ctxt)
+{
+    for (uint32_t i = 0; i < TCP_BUFFER_CLASSES; i++) {
+        while (ctxt->free_buffers[i]) {
+            struct tcp_free_buffer *free_buffer = ctxt->free_buffers[i];
+            ctxt->free_buffers[i] = free_buffer->next;
+            free(free_buffer);
+            RELAY_ATOMIC_DECREMENT(ctxt->counters->tcp_buffers_pooled, 1);
+        }
+        ctxt->n_free_buffers[i] = 0;
+    }
+}
+
+
+/* Enqueue all the complete frames in the staging buffer.  The frames are
+ * consumed in place from a read cursor, and whatever is left over is moved
+ * to the front of the buffer once, after the loop, not after every frame.
+ *
+ * A large frame that is still incomplete gets a blob of its own instead,
+ * which the rest of it is then received into, so that it is not copied
+ * around again either.
+ * Returns TCP_FAILURE if the stream is garbage, TCP_SUCCESS otherwise. */
+int tcp_consume_frames(tcp_server_context_t * ctxt, struct tcp_client *client)
+{
+    uint32_t offset = 0;
+    int grow = 0;
+
+    /* Partial header: better to declare success and retry later. */
+    while (client->pos - offset >= EXPECTED_HEADER_SIZE) {
+        unsigned char *header = client->buf + offset;
+        blob_size_t expected_packet_size = EXPECTED_PACKET_SIZE(header);
+
+        if (expected_packet_size > MAX_CHUNK_SIZE) {
+            WARN("received frame (%u) > MAX_CHUNK_SIZE (%d)", expected_packet_size, MAX_CHUNK_SIZE);
+            return TCP_FAILURE;
+        }
+
+        uint32_t available = client->pos - offset - EXPECTED_HEADER_SIZE;
+        if (available >= expected_packet_size) {
+            /* Since this packet came from a TCP connection, its first four
+             * bytes are supposed to be the length, so let's skip them. */
+            buf_to_blob_enqueue(ctxt->counters, &ctxt->batch, header + EXPECTED_HEADER_SIZE, expected_packet_size);
+            offset += EXPECTED_HEADER_SIZE + expected_packet_size;
+        } else {
+            uint32_t frame_size = EXPECTED_HEADER_SIZE + expected_packet_size;
+            if (frame_size > TCP_STAGED_FRAME_MAX) {
+                client->frame = blob_reserve(expected_packet_size);
+                memcpy(BLOB_BUF_addr(client->frame), header + EXPECTED_HEADER_SIZE, available);
+                client->frame_pos = available;
+                offset = client->pos;
+            } else if (frame_size > tcp_buffer_sizes[client->buf_class] / 2) {
+                grow = 1;
+            }
+            break;
+        }
+    }
+
+    /* [ h ] [ h ] [ h ] [ h ] [ D ] [ D ] [ D ] [ h ] [ h ] [ h ] [ h ] [ D ]
+     *                                             ^ offset(7)             ^ pos(12)
+     * the partial frame is copied to position 0, and it becomes:
+     * [ h ] [ h ] [ h ] [ h ] [ D ]
+     *                               ^ pos (5) */
+    client->pos -= offset;
+    if (client->pos > 0 && offset > 0)
+        memmove(client->buf, client->buf + offset, client->pos);
+
+    if (grow)
+        tcp_buffer_grow(ctxt, client);
+
+    return TCP_SUCCESS;
+}
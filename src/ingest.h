@@ -0,0 +1,129 @@
+#ifndef RELAY_INGEST_H
+#define RELAY_INGEST_H
+
+/* The listener side of the blobs: the batching of what the receives
+ * bring in, and the framing of the tcp streams.  Kept out of relay.c so
+ * that test/bench_tcp_framing.c links the very same framing. */
+
+#include <string.h>
+
+#include "blob.h"
+#include "log.h"
+#include "stats.h"
+
+#define EXPECTED_HEADER_SIZE sizeof(blob_size_t)
+/* The wire format is little-endian. */
+#define EXPECTED_PACKET_SIZE(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (blob_size_t) (p)[3] << 24)
+
+/* The staging buffers come in two sizes.  A client starts with a small
+ * one, and switches to a large one only for a frame that would not leave
+ * half of the small one free.  The frames larger than TCP_STAGED_FRAME_MAX
+ * are received straight into their blobs.  Keeping the frames at most half
+ * the buffer leaves room for at least as much again to be read after the
+ * compaction. */
+#define TCP_BUFFER_SMALL 0
+#define TCP_BUFFER_LARGE 1
+#define TCP_BUFFER_CLASSES 2
+extern const uint32_t tcp_buffer_sizes[TCP_BUFFER_CLASSES];
+
+#define TCP_STAGED_FRAME_MAX (tcp_buffer_sizes[TCP_BUFFER_LARGE] / 2)
+
+/* The most free buffers of each size the pool of a reactor keeps. */
+#define TCP_BUFFER_POOL_MAX 64
+
+struct tcp_client {
+    int fd;
+    /* The staging buffer, for the headers and the small frames.  It is
+     * taken from the pool only for reading, and given back as soon as
+     * there is nothing left in it, so idle clients hold no buffer. */
+    unsigned char *buf;
+    uint32_t buf_class;
+    uint32_t pos;
+    /* The frame being received directly into its blob, if any. */
+    blob_t *frame;
+    uint32_t frame_pos;
+    /* The next free slot, while this slot is on the free list. */
+    uint32_t next_free;
+};
+
+#define TCP_FAILURE 0
+#define TCP_SUCCESS 1
+
+/* A free buffer in the pool links to the next one through its first bytes. */
+struct tcp_free_buffer {
+    struct tcp_free_buffer *next;
+};
+
+/* The server socket and the client contexts.  Also used for the
+ * connection-oriented unix sockets. */
+typedef struct {
+    /* The counters of the listener thread. */
+    stats_basic_counters_t *counters;
+
+    /* The frames received by the current tcp_read(), handed to
+     * the workers in one go once it returns. */
+    queue_t batch;
+
+    int epoll_fd;
+    int server_fd;
+
+    /* If non-zero, the connections keep the message boundaries
+     * (SOCK_SEQPACKET), so there are no length headers. */
+    int seqpacket;
+
+    /* The number of connected clients. */
+    uint32_t n_clients;
+
+    /* The client slots.  A slot keeps its index for the lifetime of the
+     * connection (the index is the epoll data), and the free slots are
+     * chained through next_free, so adding and removing are O(1). */
+    struct tcp_client *clients;
+    uint32_t n_slots;
+    uint32_t free_slot;
+
+    /* The free staging buffers, shared by all the clients. */
+    struct tcp_free_buffer *free_buffers[TCP_BUFFER_CLASSES];
+    uint32_t n_free_buffers[TCP_BUFFER_CLASSES];
+} tcp_server_context_t;
+
+/* The receive paths collect what one system call brought in into a batch,
+ * which is then handed to enqueue_blobs_for_transmission() in one go. */
+static inline blob_t *buf_to_blob_enqueue(stats_basic_counters_t * counters, queue_t * batch, unsigned char *buf,
+                                          size_t size)
+{
+    blob_t *b;
+    if (size == 0) {
+        if (0)
+            WARN("Received 0 byte packet, not forwarding.");
+        return NULL;
+    }
+
+    RELAY_ATOMIC_INCREMENT(counters->received_count, 1);
+    b = blob_new(size);
+    memcpy(BLOB_BUF_addr(b), buf, size);
+    queue_append_nolock(batch, b);
+    return b;
+}
+
+/* Enqueue a reserved blob that size bytes were received into.
+ * Returns NULL if nothing was enqueued, in which case the caller
+ * still owns the blob and may receive into it again. */
+static inline blob_t *reserved_blob_enqueue(stats_basic_counters_t * counters, queue_t * batch, blob_t * b,
+                                            size_t size)
+{
+    if (size == 0)
+        return NULL;
+
+    RELAY_ATOMIC_INCREMENT(counters->received_count, 1);
+    b = blob_commit(b, size);
+    queue_append_nolock(batch, b);
+    return b;
+}
+
+/* ingest.c */
+void tcp_buffer_get(tcp_server_context_t * ctxt, struct tcp_client *client, uint32_t buf_class);
+void tcp_buffer_put(tcp_server_context_t * ctxt, struct tcp_client *client);
+void tcp_buffer_pool_close(tcp_server_context_t * ctxt);
+int tcp_consume_frames(tcp_server_context_t * ctxt, struct tcp_client *client);
+
+#endif                          /* #ifndef RELAY_INGEST_H */
@@ -0,0 +1,43 @@
+#include "memory_budget.h"
+
+#include "log.h"
+#include "string_util.h"
+
+static const char *policy_names[] = {
+    [MEMORY_BUDGET_SPILL] = "spill",
+    [MEMORY_BUDGET_DROP_OLDEST] = "drop_oldest",
+    [MEMORY_BUDGET_DROP_NEWEST] = "drop_newest",
+    [MEMORY_BUDGET_PAUSE] = "pause",
+};
+
+int memory_budget_policy_parse(const char *name)
+{
+    for (int i = 0; i < (int) (sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (name && STREQ(name, policy_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+const char *memory_budget_policy_name(int policy)
+{
+    return policy_names[policy];
+}
+
+void memory_budget_configure(memory_budget_t * budget, const config_t * config)
+{
+    int policy = memory_budget_policy_parse(config->memory_budget_policy);
+
+    if (policy < 0) {
+        /* the config check should not have let this through */
+        WARN("Unknown memory_budget_policy '%s', using spill", config->memory_budget_policy);
+        policy = MEMORY_BUDGET_SPILL;
+    }
+    budget->policy = policy;
+    budget->shed_millisec = config->memory_budget_shed_millisec;
+    budget->limit_bytes = (int64_t) config->memory_budget_mb * 1024 * 1024;
+
+    if (config->memory_budget_mb) {
+        SAY("Memory budget %u MB, policy %s", config->memory_budget_mb, policy_names[policy]);
+    }
+}
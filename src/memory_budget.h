@@ -0,0 +1,69 @@
+#ifndef RELAY_MEMORY_BUDGET_H
+#define RELAY_MEMORY_BUDGET_H
+
+/* A limit on the memory held by the blobs (memory_budget_mb), and what
+ * to do when it is reached (memory_budget_policy):
+ *
+ * spill        the workers spill to disk the blobs they have been holding
+ *              for longer than memory_budget_shed_millisec, so the stuck
+ *              destinations give up their backlog early
+ * drop_oldest  the same, but the blobs are dropped
+ * drop_newest  the incoming blobs are dropped before they are queued
+ * pause        the listeners stop reading, leaving the backpressure to
+ *              tcp, the shared memory ring, or the kernel udp buffers
+ *
+ * The usage is kept by the blob accounting (see blob.c) in per-thread
+ * slots, flushed to used_bytes in steps of MEMORY_BUDGET_FLUSH_BYTES, so
+ * checking it is a plain read, and it can be off by at most that much per
+ * thread.  While spilling, the blobs count until the disk writers have
+ * written them. */
+
+#include <stdint.h>
+
+#include "config.h"
+
+#define MEMORY_BUDGET_FLUSH_BYTES (64 * 1024)
+
+typedef enum {
+    MEMORY_BUDGET_SPILL,
+    MEMORY_BUDGET_DROP_OLDEST,
+    MEMORY_BUDGET_DROP_NEWEST,
+    MEMORY_BUDGET_PAUSE
+} memory_budget_policy_t;
+
+struct memory_budget {
+    volatile int64_t used_bytes;
+    /* zero for no limit */
+    volatile int64_t limit_bytes;
+    volatile int32_t policy;
+    volatile uint32_t shed_millisec;
+
+    /* running totals of what the policy did */
+    volatile int64_t spilled_count;
+    volatile int64_t dropped_oldest_count;
+    volatile int64_t dropped_newest_count;
+    volatile int64_t paused_count;
+};
+typedef struct memory_budget memory_budget_t;
+
+/* -1 if the name is not a policy */
+int memory_budget_policy_parse(const char *name);
+const char *memory_budget_policy_name(int policy);
+
+/* take the limit and the policy from the config, at startup and reload */
+void memory_budget_configure(memory_budget_t * budget, const config_t * config);
+
+static inline int memory_budget_over(const memory_budget_t * budget)
+{
+    int64_t limit = budget->limit_bytes;
+    return limit && budget->used_bytes > limit;
+}
+
+/* over the budget, with a policy shedding blobs already queued */
+static inline int memory_budget_shedding(const memory_budget_t * budget)
+{
+    return memory_budget_over(budget) && (budget->policy == MEMORY_BUDGET_SPILL
+                                          || budget->policy == MEMORY_BUDGET_DROP_OLDEST);
+}
+
+#endif                          /* #ifndef RELAY_MEMORY_BUDGET_H */
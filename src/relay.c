@@ -2,49 +2,143 @@
 
 #include <dlfcn.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef SO_MEMINFO
+#include <linux/sock_diag.h>
+#endif
 
+#include "blob_pool.h"
 #include "config.h"
 #include "control.h"
 #include "daemonize.h"
 #include "global.h"
+#include "ingest.h"
 #include "log.h"
+#include "memory_budget.h"
 #include "setproctitle.h"
 #include "string_util.h"
 #include "timer.h"
 #include "socket_util.h"
 #include "socket_worker_pool.h"
-
-#define EXPECTED_HEADER_SIZE sizeof(blob_size_t)
-#define ASYNC_BUFFER_SIZE (MAX_CHUNK_SIZE + EXPECTED_HEADER_SIZE)
-
-struct tcp_client {
-    unsigned char *buf;
-    uint32_t pos;
-};
+#include "shm_ring.h"
+#include "uring.h"
 
 #define PROCESS_STATUS_BUF_LEN 1024
 
 static void sig_handler(int signum);
 static void block_all_signals_inside_thread();
-static void stop_listener(pthread_t server_tid);
-static void final_shutdown(pthread_t server_tid);
-
-stats_basic_counters_t RECEIVED_STATS = {
-    .received_count = 0,        /* number of items we have received */
-    .sent_count = 0,            /* number of items we have sent */
-    .partial_count = 0,         /* number of items we have spilled */
-    .spilled_count = 0,         /* number of items we have spilled */
-    .dropped_count = 0,         /* number of items we have dropped */
-    .error_count = 0,           /* number of items that had an error */
-    .disk_count = 0,            /* number of items we have written to disk */
-
-    .send_elapsed_usec = 0,     /* elapsed time in microseconds that we spent sending data */
-    .tcp_connections = 0,       /* current number of active inbound tcp connections */
+static void stop_listener(void);
+static void final_shutdown(void);
+
+struct listener_meminfo {
+    uint32_t drops;
+    uint32_t queued_bytes;
+    uint32_t rcvbuf_bytes;
 };
 
+/* The kernel memory accounting of a datagram listener socket.
+ * Returns 0 if not available. */
+static int listener_socket_meminfo(const listener_t * listener, struct listener_meminfo *meminfo)
+{
+#ifdef SO_MEMINFO
+    uint32_t vars[SK_MEMINFO_VARS];
+    socklen_t len = sizeof(vars);
+
+    if (listener->socket.type != SOCK_DGRAM)
+        return 0;
+    if (getsockopt(listener->socket.socket, SOL_SOCKET, SO_MEMINFO, vars, &len)
+        || len <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+        return 0;
+    /* The drops are those the listener filter rejected, and those that
+     * found the receive buffer full: the kernel counts them together.
+     * The queued bytes include the kernel overhead, which is what the
+     * receive buffer size limits.  (SIOCINQ on a udp socket would only
+     * tell the size of the next datagram.) */
+    meminfo->drops = vars[SK_MEMINFO_DROPS];
+    meminfo->queued_bytes = vars[SK_MEMINFO_RMEM_ALLOC];
+    meminfo->rcvbuf_bytes = vars[SK_MEMINFO_RCVBUF];
+    return 1;
+#else
+    (void) listener;
+    (void) meminfo;
+    return 0;
+#endif
+}
+
+static stats_count_t listener_socket_drops(const listener_t * listener)
+{
+    struct listener_meminfo meminfo;
+    return listener_socket_meminfo(listener, &meminfo) ? meminfo.drops : 0;
+}
+
+/* Called when a receive batch came back full: the socket is backed up,
+ * so see how close to the receive buffer size the queue is. */
+static void listener_sample_queue(listener_t * listener)
+{
+    struct listener_meminfo meminfo;
+    if (!listener_socket_meminfo(listener, &meminfo))
+        return;
+    for (;;) {
+        uint32_t peak = listener->rxq_peak_bytes;
+        if (meminfo.queued_bytes <= peak
+            || RELAY_ATOMIC_CMPXCHG(listener->rxq_peak_bytes, peak, meminfo.queued_bytes))
+            break;
+    }
+}
+
+uint32_t listener_queue_peak(void)
+{
+    uint32_t n_listeners = RELAY_ATOMIC_READ(GLOBAL.n_listeners);
+    uint32_t max = 0;
+
+    for (uint32_t i = 0; i < n_listeners; i++) {
+        listener_t *listener = &GLOBAL.listeners[i];
+        struct listener_meminfo meminfo;
+        uint32_t peak;
+        do {
+            peak = listener->rxq_peak_bytes;
+        } while (!RELAY_ATOMIC_CMPXCHG(listener->rxq_peak_bytes, peak, 0));
+        if (listener_socket_meminfo(listener, &meminfo) && meminfo.queued_bytes > peak)
+            peak = meminfo.queued_bytes;
+        if (peak > max)
+            max = peak;
+    }
+    return max;
+}
+
+void listener_stats_sum(stats_basic_counters_t * sum)
+{
+    uint32_t n_listeners = RELAY_ATOMIC_READ(GLOBAL.n_listeners);
+
+    memset(sum, 0, sizeof(*sum));
+    for (uint32_t i = 0; i < n_listeners; i++) {
+        listener_t *listener = &GLOBAL.listeners[i];
+        struct listener_meminfo meminfo;
+        if (listener_socket_meminfo(listener, &meminfo)) {
+            sum->kernel_drops += meminfo.drops;
+            sum->rxq_bytes += meminfo.queued_bytes;
+            sum->rcvbuf_bytes += meminfo.rcvbuf_bytes;
+        }
+        sum->rxq_drops += RELAY_ATOMIC_READ(listener->rxq_drops);
+    }
+    for (int i = 0; i < MAX_LISTENER_THREADS; i++) {
+        stats_basic_counters_t *counters = &GLOBAL.listeners[i].counters;
+        sum->received_count += RELAY_ATOMIC_READ(counters->received_count);
+        sum->tcp_connections += RELAY_ATOMIC_READ(counters->tcp_connections);
+        sum->recv_call_count += RELAY_ATOMIC_READ(counters->recv_call_count);
+        sum->tcp_buffers_in_use += RELAY_ATOMIC_READ(counters->tcp_buffers_in_use);
+        sum->tcp_buffer_bytes += RELAY_ATOMIC_READ(counters->tcp_buffer_bytes);
+        sum->tcp_buffers_pooled += RELAY_ATOMIC_READ(counters->tcp_buffers_pooled);
+        sum->kernel_drops += RELAY_ATOMIC_READ(counters->kernel_drops);
+        sum->rxq_drops += RELAY_ATOMIC_READ(counters->rxq_drops);
+        sum->error_count += RELAY_ATOMIC_READ(counters->error_count);
+    }
+}
+
 static void spawn(pthread_t * tid, void *(*func) (void *), void *arg, int type)
 {
     pthread_t unused;
@@ -55,34 +149,182 @@ static void spawn(pthread_t * tid, void *(*func) (void *), void *arg, int type)
     pthread_attr_destroy(&attr);
 }
 
-static inline blob_t *buf_to_blob_enqueue(unsigned char *buf, size_t size)
+/* With the pause policy, over the memory budget the listeners stop
+ * reading, and the backlog stays with the tcp senders, the shared memory
+ * ring producers, or the kernel udp buffers (to be dropped there). */
+static void listener_budget_pause(listener_t * listener)
 {
-    blob_t *b;
-    if (size == 0) {
-        if (0)
-            WARN("Received 0 byte packet, not forwarding.");
-        return NULL;
+    memory_budget_t *budget = &GLOBAL.budget;
+
+    if (budget->policy != MEMORY_BUDGET_PAUSE || !memory_budget_over(budget))
+        return;
+
+    RELAY_ATOMIC_INCREMENT(budget->paused_count, 1);
+    while (budget->policy == MEMORY_BUDGET_PAUSE && memory_budget_over(budget)
+           && !RELAY_ATOMIC_READ(listener->stopping) && control_is_not(RELAY_STOPPING))
+        worker_wait_millisec(GLOBAL.config->polling_interval_millisec);
+}
+
+/* Room for the UDP_GRO segment size and the SO_RXQ_OVFL drop count
+ * control messages. */
+#define UDP_CONTROL_LEN (CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/* With SO_RXQ_OVFL each datagram comes with the number of datagrams the
+ * kernel has dropped on the socket so far. */
+static void udp_note_rxq_drops(listener_t * listener, struct msghdr *hdr)
+{
+#ifdef SO_RXQ_OVFL
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            listener->rxq_drops = drops;
+            return;
+        }
     }
+#else
+    (void) listener;
+    (void) hdr;
+#endif
+}
 
-    RELAY_ATOMIC_INCREMENT(RECEIVED_STATS.received_count, 1);
-    b = blob_new(size);
-    memcpy(BLOB_BUF_addr(b), buf, size);
-    enqueue_blob_for_transmission(b);
-    return b;
+#ifdef MSG_WAITFORONE
+
+/* Returns the UDP_GRO segment size of a received message,
+ * or zero if the kernel did not coalesce anything. */
+static size_t udp_gro_segment_size(struct msghdr *hdr)
+{
+#ifdef UDP_GRO
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment_size;
+            memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+            return segment_size > 0 ? (size_t) segment_size : 0;
+        }
+    }
+#else
+    (void) hdr;
+#endif
+    return 0;
 }
 
-void *udp_server(void *arg)
+/* Enqueue a datagram received into the reserved blob.  With UDP_GRO
+ * the blob may hold several datagrams of segment_size bytes each, the
+ * last one possibly shorter: those are copied out into blobs of their
+ * own.  Returns NULL if the caller still owns the blob. */
+static blob_t *udp_enqueue_segments(stats_basic_counters_t * counters, queue_t * batch, blob_t * b, size_t size,
+                                    size_t segment_size)
 {
-    block_all_signals_inside_thread();
+    if (segment_size == 0 || segment_size >= size)
+        return reserved_blob_enqueue(counters, batch, b, size);
+
+    unsigned char *buf = (unsigned char *) BLOB_BUF_addr(b);
+    for (size_t offset = 0; offset < size; offset += segment_size) {
+        size_t left = size - offset;
+        buf_to_blob_enqueue(counters, batch, buf + offset, left < segment_size ? left : segment_size);
+    }
+    return NULL;
+}
 
-    relay_socket_t *s = (relay_socket_t *) arg;
+/* Receive up to batch datagrams per recvmmsg() call.  MSG_WAITFORONE
+ * makes the call block only until the first datagram arrives.
+ *
+ * The datagrams are received straight into reserved blobs, which are
+ * trimmed and enqueued as they are, and replaced by fresh ones.  The
+ * whole batch goes to the workers at once. */
+static void udp_server_recvmmsg(listener_t * listener, unsigned int batch)
+{
+    relay_socket_t *s = &listener->socket;
+    blob_t **blobs = calloc_or_fatal(batch * sizeof(blob_t *));
+    char *control = calloc_or_fatal((size_t) batch * UDP_CONTROL_LEN);
+    struct iovec *iovs = calloc_or_fatal(batch * sizeof(struct iovec));
+    struct mmsghdr *msgs = calloc_or_fatal(batch * sizeof(struct mmsghdr));
+    queue_t received_blobs;
+
+    memset(&received_blobs, 0, sizeof(received_blobs));
+
+    for (unsigned int i = 0; i < batch; i++) {
+        iovs[i].iov_len = MAX_CHUNK_SIZE;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control + (size_t) i * UDP_CONTROL_LEN;
+    }
+
+    while (control_is_not(RELAY_STOPPING)) {
+        listener_budget_pause(listener);
+
+        /* The kernel overwrites these with the lengths actually used. */
+        for (unsigned int i = 0; i < batch; i++) {
+            if (!blobs[i]) {
+                blobs[i] = blob_reserve(MAX_CHUNK_SIZE);
+                iovs[i].iov_base = BLOB_BUF_addr(blobs[i]);
+            }
+            msgs[i].msg_hdr.msg_controllen = UDP_CONTROL_LEN;
+        }
+
+        int received = recvmmsg(s->socket, msgs, batch, MSG_WAITFORONE, NULL);
+        if (received < 0) {
+            WARN_ERRNO("recvmmsg failed");
+            break;
+        }
+        RELAY_ATOMIC_INCREMENT(listener->counters.recv_call_count, 1);
+        for (int i = 0; i < received; i++) {
+            /* A datagram cut short by the receive buffer is not forwarded,
+             * nor split into segments: the blob is received into again. */
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                RELAY_ATOMIC_INCREMENT(listener->counters.error_count, 1);
+                continue;
+            }
+            if (udp_enqueue_segments(&listener->counters, &received_blobs, blobs[i], msgs[i].msg_len,
+                                     udp_gro_segment_size(&msgs[i].msg_hdr)))
+                blobs[i] = NULL;
+        }
+        enqueue_blobs_for_transmission(&received_blobs);
+        /* The drop count is cumulative, the latest one will do. */
+        if (received > 0)
+            udp_note_rxq_drops(listener, &msgs[received - 1].msg_hdr);
+        if ((unsigned int) received == batch)
+            listener_sample_queue(listener);
+    }
+
+    for (unsigned int i = 0; i < batch; i++) {
+        if (blobs[i])
+            blob_release_reserved(blobs[i]);
+    }
+    free(msgs);
+    free(iovs);
+    free(control);
+    free(blobs);
+}
+#endif                          /* #ifdef MSG_WAITFORONE */
+
+static void udp_server_recv(listener_t * listener)
+{
+    relay_socket_t *s = &listener->socket;
 #ifdef PACKETS_PER_SECOND
     uint32_t packets = 0, prev_packets = 0;
     uint32_t epoch, prev_epoch = 0;
 #endif
-    unsigned char buf[MAX_CHUNK_SIZE];
+    blob_t *b = NULL;
+    char control[UDP_CONTROL_LEN];
+    struct iovec iov;
+    struct msghdr hdr;
+    queue_t received_blobs;
+
+    memset(&received_blobs, 0, sizeof(received_blobs));
+    memset(&hdr, 0, sizeof(hdr));
+    iov.iov_len = MAX_CHUNK_SIZE;
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+
     while (control_is_not(RELAY_STOPPING)) {
-        ssize_t received = recv(s->socket, buf, MAX_CHUNK_SIZE, 0);
+        listener_budget_pause(listener);
+        if (!b)
+            b = blob_reserve(MAX_CHUNK_SIZE);
+        iov.iov_base = BLOB_BUF_addr(b);
+        hdr.msg_controllen = sizeof(control);
+        ssize_t received = recvmsg(s->socket, &hdr, 0);
 #ifdef PACKETS_PER_SECOND
         if ((epoch = time(0)) != prev_epoch) {
             SAY("packets: %d", packets - prev_packets);
@@ -95,263 +337,519 @@ void *udp_server(void *arg)
             WARN_ERRNO("recv failed");
             break;
         }
-        buf_to_blob_enqueue(buf, received);
-    }
-    if (control_is(RELAY_RELOADING)) {
-        /* Race condition, but might help in debugging */
-        WARN("udp server failed, but relay seemingly reloading");
+        RELAY_ATOMIC_INCREMENT(listener->counters.recv_call_count, 1);
+        udp_note_rxq_drops(listener, &hdr);
+        if (hdr.msg_flags & MSG_TRUNC) {
+            RELAY_ATOMIC_INCREMENT(listener->counters.error_count, 1);
+            continue;
+        }
+        if (reserved_blob_enqueue(&listener->counters, &received_blobs, b, received)) {
+            enqueue_blobs_for_transmission(&received_blobs);
+            b = NULL;
+        }
     }
-    pthread_exit(NULL);
+    if (b)
+        blob_release_reserved(b);
+}
+
+#ifdef HAVE_IO_URING
+/* The user_data of the multishot receive, and of its cancellation. */
+#define UDP_URING_RECV 1
+#define UDP_URING_CANCEL 2
+
+/* Arm the multishot receive: it keeps completing, one datagram per
+ * completion, until the kernel runs out of buffers or something fails. */
+static int udp_uring_arm(uring_t * ring, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return 0;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    /* With MSG_TRUNC the result is the full length of the datagram,
+     * so the truncated ones can be told apart. */
+    sqe->msg_flags = MSG_TRUNC;
+    sqe->user_data = UDP_URING_RECV;
+    return 1;
 }
 
-/* The wire format is little-endian. */
-#define EXPECTED_PACKET_SIZE(x) ((x)->buf[0] | (x)->buf[1] << 8 | (x)->buf[2] << 16 | (x)->buf[3] << 24)
+/* Receive with an io_uring multishot receive.  The kernel picks the
+ * buffers from a ring of reserved blobs, the blob index being the buffer
+ * id, so as with recvmmsg() the datagrams are enqueued without copying.
+ * Returns 0 if io_uring could not be set up, so that the caller can
+ * fall back to the plain system calls. */
+static int udp_server_uring(listener_t * listener, unsigned int batch)
+{
+    relay_socket_t *s = &listener->socket;
+    uring_t ring;
+    uring_buf_ring_t buf_ring;
+    unsigned int n_blobs = 8;
+
+    /* The buffer ring size must be a power of two. */
+    while (n_blobs < batch)
+        n_blobs <<= 1;
+
+    if (!uring_init(&ring, 8)) {
+        WARN_ERRNO("io_uring setup failed, not using io_uring");
+        return 0;
+    }
+    if (!uring_buf_ring_init(&ring, &buf_ring, n_blobs, 0)) {
+        WARN_ERRNO("io_uring buffer ring setup failed, not using io_uring");
+        uring_close(&ring);
+        return 0;
+    }
 
-/* The server socket and the client contexts. */
-typedef struct {
-    /* The number of clients. */
-    volatile nfds_t nfds;
+    blob_t **blobs = calloc_or_fatal(n_blobs * sizeof(blob_t *));
+    queue_t received_blobs;
 
-    /* The file descriptors.  The pfds[0] is the server socket,
-     * the pfds[1...] are the client sockets. */
-    struct pollfd *pfds;
+    memset(&received_blobs, 0, sizeof(received_blobs));
+    for (unsigned int i = 0; i < n_blobs; i++) {
+        blobs[i] = blob_reserve(MAX_CHUNK_SIZE);
+        uring_buf_ring_add(&buf_ring, BLOB_BUF_addr(blobs[i]), MAX_CHUNK_SIZE, i);
+    }
+    uring_buf_ring_publish(&buf_ring);
+
+    int armed = 0;
+    int failed = 0;
+    while (!failed && control_is_not(RELAY_STOPPING) && !RELAY_ATOMIC_READ(listener->stopping)) {
+        listener_budget_pause(listener);
+        if (!armed)
+            armed = udp_uring_arm(&ring, s->socket);
+
+        /* Time out to notice the stopping, the socket being shut
+         * down does not end the multishot receive. */
+        if (uring_submit_and_wait(&ring, 1, s->polling_interval_millisec) < 0 && errno != ETIME
+            && errno != EINTR) {
+            WARN_ERRNO("io_uring_enter failed");
+            break;
+        }
 
-    /* The clients[0] is unused (it is the server),
-     * the pfds[1..] are the client contexts. */
-    struct tcp_client *clients;
-} tcp_server_context_t;
+        int completed = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&ring))) {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                armed = 0;
+            if (cqe->res < 0) {
+                /* Out of buffers is not an error: they are given
+                 * back below, and the receive is then rearmed. */
+                if (cqe->res != -ENOBUFS) {
+                    errno = -cqe->res;
+                    WARN_ERRNO("io_uring receive failed");
+                    failed = 1;
+                }
+            } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+                uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                if (cqe->res > MAX_CHUNK_SIZE) {
+                    /* truncated, see udp_uring_arm() */
+                    RELAY_ATOMIC_INCREMENT(listener->counters.error_count, 1);
+                } else if (reserved_blob_enqueue(&listener->counters, &received_blobs, blobs[bid], cqe->res)) {
+                    blobs[bid] = blob_reserve(MAX_CHUNK_SIZE);
+                }
+                uring_buf_ring_add(&buf_ring, BLOB_BUF_addr(blobs[bid]), MAX_CHUNK_SIZE, bid);
+                completed++;
+            }
+            uring_cqe_seen(&ring);
+        }
+        if (completed) {
+            enqueue_blobs_for_transmission(&received_blobs);
+            uring_buf_ring_publish(&buf_ring);
+            RELAY_ATOMIC_INCREMENT(listener->counters.recv_call_count, 1);
+        }
+    }
 
-#define TCP_FAILURE 0
-#define TCP_SUCCESS 1
+    /* Cancel the receive and wait for it to end before releasing
+     * the blobs, the kernel might still be receiving into them. */
+    if (armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = UDP_URING_RECV;
+            sqe->user_data = UDP_URING_CANCEL;
+        }
+        while (armed) {
+            if (uring_submit_and_wait(&ring, 1, s->polling_interval_millisec) < 0 && errno != ETIME
+                && errno != EINTR)
+                break;
+            struct io_uring_cqe *cqe;
+            while ((cqe = uring_peek_cqe(&ring))) {
+                if (cqe->user_data == UDP_URING_RECV && !(cqe->flags & IORING_CQE_F_MORE))
+                    armed = 0;
+                uring_cqe_seen(&ring);
+            }
+        }
+    }
 
-static void tcp_context_init(tcp_server_context_t * ctxt)
+    uring_buf_ring_close(&ring, &buf_ring);
+    uring_close(&ring);
+    for (unsigned int i = 0; i < n_blobs; i++)
+        blob_release_reserved(blobs[i]);
+    free(blobs);
+
+    return 1;
+}
+#endif                          /* #ifdef HAVE_IO_URING */
+
+void *udp_server(void *arg)
 {
-    ctxt->nfds = 0;
+    block_all_signals_inside_thread();
 
-    /* Just the server socket. */
-    ctxt->pfds = calloc_or_fatal(sizeof(struct pollfd));
-    if (ctxt->pfds == NULL)
-        return;
+    listener_t *listener = (listener_t *) arg;
+    const config_t *config = GLOBAL.config;
 
-    /* tcp_add_fd() will set this right soon. */
-    ctxt->pfds[0].fd = -1;
+    if (config->io_uring && config->udp_gro) {
+        WARN("io_uring receives no UDP_GRO segment sizes, not using io_uring");
+    } else if (config->io_uring) {
+#ifdef HAVE_IO_URING
+        if (udp_server_uring(listener, config->udp_recv_batch))
+            goto out;
+#else
+        WARN("Built without io_uring, not using io_uring");
+#endif
+    }
+#ifdef MSG_WAITFORONE
+    /* UDP_GRO needs the control messages, so it implies recvmmsg(). */
+    if (config->udp_recv_batch > 1 || config->udp_gro)
+        udp_server_recvmmsg(listener, config->udp_recv_batch);
+    else
+        udp_server_recv(listener);
+#else
+    if (config->udp_recv_batch > 1 || config->udp_gro)
+        WARN("recvmmsg() not available, receiving one datagram at a time");
+    udp_server_recv(listener);
+#endif
+#ifdef HAVE_IO_URING
+  out:
+#endif
+    if (control_is(RELAY_RELOADING)) {
+        /* Race condition, but might help in debugging */
+        WARN("udp server failed, but relay seemingly reloading");
+    }
+    pthread_exit(NULL);
+}
 
-    /* The clients[0] is unused but let's make it a "null client" so
-     * that looping over the contexts can have less special cases. */
-    ctxt->clients = calloc_or_fatal(sizeof(struct tcp_client));
-    if (ctxt->clients == NULL)
-        return;
+/* The epoll data of the server socket, the clients use their slot index. */
+#define TCP_SERVER_SLOT ((uint32_t) -1)
+/* The end of the free slot list. */
+#define TCP_NO_SLOT ((uint32_t) -1)
 
-    ctxt->clients[0].buf = NULL;
-    ctxt->clients[0].pos = 0;
+#define TCP_INITIAL_SLOTS 16
+#define TCP_EPOLL_EVENTS 256
+/* The most connections accepted per wakeup, so that a connection storm
+ * does not starve the reads.  The server socket is level-triggered, so
+ * the rest are picked up on the next round. */
+#define TCP_ACCEPT_BATCH 64
+
+static int tcp_context_init(tcp_server_context_t * ctxt, stats_basic_counters_t * counters, int server_fd,
+                            int seqpacket)
+{
+    memset(ctxt, 0, sizeof(*ctxt));
+    ctxt->counters = counters;
+    ctxt->server_fd = server_fd;
+    ctxt->seqpacket = seqpacket;
+    ctxt->free_slot = TCP_NO_SLOT;
+
+    ctxt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctxt->epoll_fd == -1) {
+        WARN_ERRNO("epoll_create1");
+        return TCP_FAILURE;
+    }
+
+    /* Level-triggered, see TCP_ACCEPT_BATCH. */
+    struct epoll_event ev = {.events = EPOLLIN,.data.u32 = TCP_SERVER_SLOT };
+    if (epoll_ctl(ctxt->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+        WARN_ERRNO("epoll_ctl add server fd %d", server_fd);
+        return TCP_FAILURE;
+    }
+
+    return TCP_SUCCESS;
 }
 
-static void tcp_add_fd(tcp_server_context_t * ctxt, int fd)
+/* Take a slot off the free list, doubling the slots if none are free.
+ * Growing moves the slots, but nothing holds pointers to them across
+ * the event loop iterations: epoll only knows the indices. */
+static uint32_t tcp_slot_alloc(tcp_server_context_t * ctxt)
 {
-    setnonblocking(fd);
-    ctxt->pfds[ctxt->nfds].fd = fd;
-    ctxt->pfds[ctxt->nfds].events = POLLIN;
-    ctxt->nfds++;
+    if (ctxt->free_slot == TCP_NO_SLOT) {
+        uint32_t n_slots = ctxt->n_slots ? 2 * ctxt->n_slots : TCP_INITIAL_SLOTS;
+        ctxt->clients = realloc_or_fatal(ctxt->clients, n_slots * sizeof(struct tcp_client));
+        for (uint32_t i = n_slots; i-- > ctxt->n_slots;) {
+            ctxt->clients[i].fd = -1;
+            ctxt->clients[i].buf = NULL;
+            ctxt->clients[i].buf_class = TCP_BUFFER_SMALL;
+            ctxt->clients[i].pos = 0;
+            ctxt->clients[i].frame = NULL;
+            ctxt->clients[i].frame_pos = 0;
+            ctxt->clients[i].next_free = ctxt->free_slot;
+            ctxt->free_slot = i;
+        }
+        ctxt->n_slots = n_slots;
+    }
+
+    uint32_t slot = ctxt->free_slot;
+    ctxt->free_slot = ctxt->clients[slot].next_free;
+    return slot;
 }
 
-static void tcp_context_realloc(tcp_server_context_t * ctxt, nfds_t n)
+static void tcp_slot_free(tcp_server_context_t * ctxt, uint32_t slot)
 {
-    ctxt->pfds = realloc_or_fatal(ctxt->pfds, n * sizeof(struct pollfd));
-    ctxt->clients = realloc_or_fatal(ctxt->clients, n * sizeof(struct tcp_client));
+    ctxt->clients[slot].next_free = ctxt->free_slot;
+    ctxt->free_slot = slot;
 }
 
-/* Returns TCP_FAILURE if failed, TCP_SUCCESS if successful.
+/* Accept the pending connections, at most TCP_ACCEPT_BATCH of them.
+ * Returns TCP_FAILURE if failed, TCP_SUCCESS if successful.
  * If not successful the server should probably exit. */
-static int tcp_accept(tcp_server_context_t * ctxt, int server_fd)
+static int tcp_accept(tcp_server_context_t * ctxt)
 {
-    int fd = accept(server_fd, NULL, NULL);
-    if (fd == -1) {
-        WARN_ERRNO("accept");
-        return TCP_FAILURE;
-    }
-    RELAY_ATOMIC_INCREMENT(RECEIVED_STATS.tcp_connections, 1);
+    for (int accepted = 0; accepted < TCP_ACCEPT_BATCH; accepted++) {
+        int fd = accept4(ctxt->server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return TCP_SUCCESS;
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            WARN_ERRNO("accept");
+            return TCP_FAILURE;
+        }
 
-    tcp_context_realloc(ctxt, ctxt->nfds + 1);
+        uint32_t slot = tcp_slot_alloc(ctxt);
+        struct tcp_client *client = &ctxt->clients[slot];
 
-    ctxt->clients[ctxt->nfds].pos = 0;
-    ctxt->clients[ctxt->nfds].buf = calloc_or_fatal(ASYNC_BUFFER_SIZE);
-    ctxt->pfds[ctxt->nfds].revents = 0;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,.data.u32 = slot };
+        if (epoll_ctl(ctxt->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            WARN_ERRNO("epoll_ctl add client fd %d", fd);
+            close(fd);
+            tcp_slot_free(ctxt, slot);
+            continue;
+        }
 
-    tcp_add_fd(ctxt, fd);
+        /* The staging buffer is only taken once there is something to read. */
+        client->fd = fd;
+        client->pos = 0;
 
-    /* WARN("CREATE %p fd: %d", ctxt->clients[ctxt->nfds].buf, fd); */
+        ctxt->n_clients++;
+        RELAY_ATOMIC_INCREMENT(ctxt->counters->tcp_connections, 1);
+    }
 
     return TCP_SUCCESS;
 }
 
+/* A SOCK_SEQPACKET connection keeps the message boundaries, so as with
+ * the datagrams each message is received straight into a blob of its own.
+ * The reserved blob is only kept while draining, idle clients hold none.
+ * Returns like tcp_read(). */
+static int tcp_read_packets(tcp_server_context_t * ctxt, struct tcp_client *client)
+{
+    for (;;) {
+        if (!client->frame)
+            client->frame = blob_reserve(MAX_CHUNK_SIZE);
+
+        struct iovec iov = {.iov_base = BLOB_BUF_addr(client->frame),.iov_len = MAX_CHUNK_SIZE };
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+
+        ssize_t received = recvmsg(client->fd, &hdr, 0);
+        RELAY_ATOMIC_INCREMENT(ctxt->counters->recv_call_count, 1);
+        if (received <= 0) {
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                blob_release_reserved(client->frame);
+                client->frame = NULL;
+                return TCP_SUCCESS;
+            }
+            if (received == -1 && errno == EINTR)
+                continue;
+
+            return TCP_FAILURE;
+        }
+
+        /* A message longer than a blob can hold is dropped, not forwarded
+         * cut short: the blob is received into again. */
+        if (hdr.msg_flags & MSG_TRUNC) {
+            RELAY_ATOMIC_INCREMENT(ctxt->counters->error_count, 1);
+            continue;
+        }
+        if (reserved_blob_enqueue(ctxt->counters, &ctxt->batch, client->frame, received))
+            client->frame = NULL;
+    }
+}
+
 /* Returns TCP_FAILURE if failed, TCP_SUCCESS if successful.
  * If successful, we should move on to the next connection.
  * (Note that the success may be a full or a partial packet.)
- * If not successful, this connection should probably be removed. */
-static int tcp_read(tcp_server_context_t * ctxt, nfds_t i)
+ * If not successful, this connection should probably be removed.
+ *
+ * The clients are edge-triggered, so keep reading until the socket
+ * has been drained, otherwise we would not hear of it again. */
+static int tcp_read(tcp_server_context_t * ctxt, uint32_t slot)
 {
-    if (!(i < ctxt->nfds)) {
-        WARN("Unexpected fd %d", (int) i);
+    if (!(slot < ctxt->n_slots) || ctxt->clients[slot].fd == -1) {
+        WARN("Unexpected slot %u", slot);
         return TCP_FAILURE;
     }
 
-    struct tcp_client *client = &ctxt->clients[i];
-
-    /* try to read as much as possible */
-    ssize_t try_to_read = ASYNC_BUFFER_SIZE - (int) client->pos;
-
-    if (try_to_read <= 0) {
-        WARN("Invalid length: %zd, pos: %u", try_to_read, client->pos);
-        return TCP_FAILURE;
-    }
+    struct tcp_client *client = &ctxt->clients[slot];
 
-    ssize_t received = recv(ctxt->pfds[i].fd, client->buf + client->pos, try_to_read, 0);
-    if (received <= 0) {
-        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-            return TCP_SUCCESS;
+    if (ctxt->seqpacket)
+        return tcp_read_packets(ctxt, client);
 
-        return TCP_FAILURE;
-    }
+    for (;;) {
+        unsigned char *dst;
+        ssize_t try_to_read;
 
-    client->pos += received;
+        /* Either the rest of the current frame, or as much as possible. */
+        if (client->frame) {
+            dst = (unsigned char *) BLOB_BUF_addr(client->frame) + client->frame_pos;
+            try_to_read = BLOB_BUF_SIZE(client->frame) - client->frame_pos;
+        } else {
+            if (!client->buf)
+                tcp_buffer_get(ctxt, client, TCP_BUFFER_SMALL);
+            dst = client->buf + client->pos;
+            try_to_read = tcp_buffer_sizes[client->buf_class] - client->pos;
+        }
 
-    /* NOTE: the flow control of this loop is somewhat unusual. */
-    for (;;) {
-        /* Partial header: better to declare success and retry later. */
-        if (client->pos < EXPECTED_HEADER_SIZE)
-            return TCP_SUCCESS;
+        if (try_to_read <= 0) {
+            WARN("Invalid length: %zd, pos: %u", try_to_read, client->pos);
+            return TCP_FAILURE;
+        }
 
-        blob_size_t expected_packet_size = EXPECTED_PACKET_SIZE(client);
+        ssize_t received = recv(client->fd, dst, try_to_read, 0);
+        RELAY_ATOMIC_INCREMENT(ctxt->counters->recv_call_count, 1);
+        if (received <= 0) {
+            if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (received == -1 && errno == EINTR)
+                continue;
 
-        if (expected_packet_size > MAX_CHUNK_SIZE) {
-            WARN("received frame (%d) > MAX_CHUNK_SIZE (%d)", expected_packet_size, MAX_CHUNK_SIZE);
             return TCP_FAILURE;
         }
 
-        if (client->pos >= expected_packet_size + EXPECTED_HEADER_SIZE) {
-            /* Since this packet came from a TCP connection, its first four
-             * bytes are supposed to be the length, so let's skip them. */
-            buf_to_blob_enqueue(client->buf + EXPECTED_HEADER_SIZE, expected_packet_size);
-
-            client->pos -= expected_packet_size + EXPECTED_HEADER_SIZE;
-            if (client->pos > 0) {
-                /* [ h ] [ h ] [ h ] [ h ] [ D ] [ D ] [ D ] [ h ] [ h ] [ h ] [ h ] [ D ]
-                 *                                                                     ^ pos(12)
-                 * after we remove the first packet + header it becomes:
-                 * [ h ] [ h ] [ h ] [ h ] [ D ] [ D ] [ D ] [ h ] [ h ] [ h ] [ h ] [ D ]
-                 *                           ^ pos (5)
-                 * and then we copy from header + data, to position 0, 5 bytes
-                 *
-                 * [ h ] [ h ] [ h ] [ h ] [ D ]
-                 *                           ^ pos (5) */
-
-                memmove(client->buf, client->buf + EXPECTED_HEADER_SIZE + expected_packet_size, client->pos);
-                if (client->pos >= EXPECTED_HEADER_SIZE)
-                    continue;   /* there is one more packet left in the buffer, consume it */
+        if (client->frame) {
+            client->frame_pos += received;
+            if (client->frame_pos == BLOB_BUF_SIZE(client->frame)) {
+                /* The frames given a blob of their own are never empty,
+                 * so this always takes over the blob. */
+                reserved_blob_enqueue(ctxt->counters, &ctxt->batch, client->frame, client->frame_pos);
+                client->frame = NULL;
+                client->frame_pos = 0;
             }
+        } else {
+            client->pos += received;
+            if (!tcp_consume_frames(ctxt, client))
+                return TCP_FAILURE;
         }
 
-        return TCP_SUCCESS;
+        /* A short read means the socket was drained: anything arriving
+         * after the recv() raises a new edge, so we can skip the recv()
+         * that would just say EAGAIN. */
+        if (received < try_to_read)
+            break;
     }
+
+    /* Nothing buffered: the client goes idle without a buffer. */
+    if (client->buf && client->pos == 0)
+        tcp_buffer_put(ctxt, client);
+
+    return TCP_SUCCESS;
 }
 
-/* Close the given client connection. */
-static void tcp_client_close(tcp_server_context_t * ctxt, nfds_t i)
+/* Close the given client connection and release its slot. */
+static void tcp_client_remove(tcp_server_context_t * ctxt, uint32_t slot)
 {
-    if (!(i < ctxt->nfds)) {
-        WARN("Unexpected fd %d", (int) i);
+    if (!(slot < ctxt->n_slots) || ctxt->clients[slot].fd == -1) {
+        WARN("Unexpected slot %u", slot);
         return;
     }
 
-    /* We could pass in both client and i, but then there's danger of mismatch. */
-    struct tcp_client *client = &ctxt->clients[i];
-
-    /* WARN("[%d] DESTROY %p %d %d fd: %d vs %d", i, client->buf, client->x, i, ctxt->pfds[i].fd, client->fd); */
+    struct tcp_client *client = &ctxt->clients[slot];
 
     /* In addition to releasing resources (free, close) also reset
      * the various fields to invalid values (NULL, -1) just in case
-     * someone accidentally tries using them. */
-    shutdown(ctxt->pfds[i].fd, SHUT_RDWR);
-    close(ctxt->pfds[i].fd);
-    ctxt->pfds[i].fd = -1;
-    free(client->buf);
-    client->buf = NULL;
-}
-
-/* Remove the client connection (first closes it) */
-static void tcp_client_remove(tcp_server_context_t * ctxt, nfds_t i)
-{
-    if (!(i < ctxt->nfds)) {
-        WARN("Unexpected fd %d", (int) i);
-        return;
+     * someone accidentally tries using them.  Closing the fd also
+     * removes it from the epoll set. */
+    shutdown(client->fd, SHUT_RDWR);
+    close(client->fd);
+    client->fd = -1;
+    if (client->buf)
+        tcp_buffer_put(ctxt, client);
+    client->pos = 0;
+    if (client->frame) {
+        blob_release_reserved(client->frame);
+        client->frame = NULL;
+        client->frame_pos = 0;
     }
 
-    tcp_client_close(ctxt, i);
-
-    /* Remove the connection by shifting left
-     * the connections coming after it. */
-    {
-        nfds_t tail = ctxt->nfds - i - 1;
-        assert(tail < ctxt->nfds);
-        memcpy(ctxt->pfds + i, ctxt->pfds + i + 1, tail * sizeof(struct pollfd));
-        memcpy(ctxt->clients + i, ctxt->clients + i + 1, tail * sizeof(struct tcp_client));
-    }
+    tcp_slot_free(ctxt, slot);
 
-    ctxt->nfds--;
-    tcp_context_realloc(ctxt, ctxt->nfds);
-    RELAY_ATOMIC_DECREMENT(RECEIVED_STATS.tcp_connections, 1);
+    ctxt->n_clients--;
+    RELAY_ATOMIC_DECREMENT(ctxt->counters->tcp_connections, 1);
 }
 
 static void tcp_context_close(tcp_server_context_t * ctxt)
 {
-    for (nfds_t i = 0; i < ctxt->nfds; i++) {
-        tcp_client_close(ctxt, i);
+    for (uint32_t i = 0; i < ctxt->n_slots; i++) {
+        if (ctxt->clients[i].fd != -1)
+            tcp_client_remove(ctxt, i);
     }
+    tcp_buffer_pool_close(ctxt);
+    if (ctxt->epoll_fd != -1)
+        close(ctxt->epoll_fd);
     /* Release and reset. */
-    free(ctxt->pfds);
     free(ctxt->clients);
-    ctxt->nfds = 0;             /* Cannot be -1 since nfds_t is unsigned. */
-    ctxt->pfds = NULL;
+    ctxt->epoll_fd = -1;
     ctxt->clients = NULL;
+    ctxt->n_slots = 0;
+    ctxt->free_slot = TCP_NO_SLOT;
 }
 
 void *tcp_server(void *arg)
 {
     block_all_signals_inside_thread();
 
-    relay_socket_t *s = (relay_socket_t *) arg;
+    listener_t *listener = (listener_t *) arg;
+    relay_socket_t *s = &listener->socket;
     tcp_server_context_t ctxt;
+    struct epoll_event events[TCP_EPOLL_EVENTS];
 
-    tcp_context_init(&ctxt);
-
-    tcp_add_fd(&ctxt, s->socket);
+    RELAY_ATOMIC_AND(listener->counters.tcp_connections, 0);
 
-    RELAY_ATOMIC_AND(RECEIVED_STATS.tcp_connections, 0);
+    if (!tcp_context_init(&ctxt, &listener->counters, s->socket, s->type == SOCK_SEQPACKET))
+        goto out;
 
     for (;;) {
-        int rc = poll(ctxt.pfds, ctxt.nfds, s->polling_interval_millisec);
+        listener_budget_pause(listener);
+        int rc = epoll_wait(ctxt.epoll_fd, events, TCP_EPOLL_EVENTS, s->polling_interval_millisec);
         if (rc == -1) {
             if (errno == EINTR)
                 continue;
-            WARN_ERRNO("poll");
+            WARN_ERRNO("epoll_wait");
             goto out;
-        } else {
-            for (nfds_t i = 0; i < ctxt.nfds; i++) {
-                if (!ctxt.pfds[i].revents)
-                    continue;
-                if (ctxt.pfds[i].fd == s->socket) {
-                    if (!tcp_accept(&ctxt, s->socket))
-                        goto out;
-                } else {
-                    if (!tcp_read(&ctxt, i))
-                        tcp_client_remove(&ctxt, i);
-                }
+        }
+        /* A shut down unix socket keeps on listening, and polling as
+         * hung up, so the stopping has to be checked for explicitly. */
+        if (RELAY_ATOMIC_READ(listener->stopping))
+            goto out;
+        for (int i = 0; i < rc; i++) {
+            uint32_t slot = events[i].data.u32;
+            if (slot == TCP_SERVER_SLOT) {
+                if (!tcp_accept(&ctxt))
+                    goto out;
+            } else {
+                /* Errors and hangups show up as failed reads. */
+                if (!tcp_read(&ctxt, slot))
+                    tcp_client_remove(&ctxt, slot);
+                enqueue_blobs_for_transmission(&ctxt.batch);
             }
         }
     }
 
   out:
     tcp_context_close(&ctxt);
+    RELAY_ATOMIC_AND(listener->counters.tcp_connections, 0);
     if (control_is(RELAY_RELOADING)) {
         /* Race condition, but might help in debugging */
         WARN("tcp server failed, but relay seemingly reloading");
@@ -359,34 +857,150 @@ void *tcp_server(void *arg)
     pthread_exit(NULL);
 }
 
-pthread_t setup_listener(config_t * config)
+#ifdef HAVE_SHM_RING
+/* How many frames to drain before handing their space back to the producers. */
+#define SHM_RELEASE_BATCH 64
+
+/* The shm@/name listener: copies the frames the producers on this host
+ * wrote into the shared memory ring into blobs.  Sleeps on the doorbell
+ * only when the ring is empty, so under load there are no system calls. */
+void *shm_server(void *arg)
 {
-    pthread_t server_tid = 0;
+    block_all_signals_inside_thread();
+
+    listener_t *listener = (listener_t *) arg;
+    relay_socket_t *s = &listener->socket;
+    const char *name = s->arg + strlen(SHM_PREFIX);
+    shm_ring_t ring;
+    queue_t received_blobs;
+
+    memset(&received_blobs, 0, sizeof(received_blobs));
+    if (shm_ring_create(&ring, name, GLOBAL.config->shm_ring_bytes)) {
+        WARN_ERRNO("Failed to create the shared memory ring %s", name);
+        pthread_exit(NULL);
+    }
+    SAY("Created the shared memory ring %s of %u bytes", name, GLOBAL.config->shm_ring_bytes);
+
+    while (!RELAY_ATOMIC_READ(listener->stopping)) {
+        uint32_t size;
+        int rc;
+        int drained = 0;
+
+        listener_budget_pause(listener);
+
+        while ((rc = shm_ring_next(&ring, &size)) == 1) {
+            if (size) {
+                blob_t *b = blob_new(size);
+                shm_ring_read(&ring, BLOB_BUF_addr(b), size);
+                RELAY_ATOMIC_INCREMENT(listener->counters.received_count, 1);
+                queue_append_nolock(&received_blobs, b);
+            } else {
+                unsigned char empty;
+                shm_ring_read(&ring, &empty, 0);
+            }
+            if (++drained % SHM_RELEASE_BATCH == 0) {
+                enqueue_blobs_for_transmission(&received_blobs);
+                shm_ring_release(&ring);
+            }
+        }
+        if (rc < 0) {
+            WARN("%s: corrupt frame in the shared memory ring, dropping its contents", s->to_string);
+            shm_ring_reset(&ring);
+        }
+        enqueue_blobs_for_transmission(&received_blobs);
+        shm_ring_release(&ring);
+
+        if (drained) {
+            RELAY_ATOMIC_INCREMENT(listener->counters.recv_call_count, 1);
+        } else {
+            shm_ring_wait(&ring, s->polling_interval_millisec);
+        }
+    }
+
+    uint64_t dropped = RELAY_ATOMIC_READ(ring.hdr->dropped);
+    if (dropped)
+        WARN("%s: the producers found the ring full %lu times", s->to_string, (unsigned long) dropped);
+    shm_ring_destroy(&ring);
+    pthread_exit(NULL);
+}
+#endif                          /* #ifdef HAVE_SHM_RING */
 
+void setup_listener(config_t * config)
+{
     if (config == NULL || config->argv == NULL || GLOBAL.listener == NULL
         || !socketize(config->argv[0], GLOBAL.listener, IPPROTO_UDP, RELAY_CONN_IS_INBOUND, "listener")) {
         FATAL("Failed to socketize listener");
-        return 0;
+        return;
     }
 
     GLOBAL.listener->polling_interval_millisec = config->polling_interval_millisec;
 
-    /* must open the socket BEFORE we create the worker pool */
-    open_socket(GLOBAL.listener, DO_BIND | DO_REUSEADDR |
+    /* For tcp each listener thread is a reactor with its own accept
+     * socket and its own set of client connections. */
+    uint32_t n_listeners = config->listener_threads;
+    int is_unix = GLOBAL.listener->sa.un.sun_family == AF_UNIX;
+    int is_shm = GLOBAL.listener->proto == SOCK_FAKE_SHM;
+
+    if (is_shm) {
+#ifdef HAVE_SHM_RING
+        /* There is nothing to shard: the producers serialize on the ring. */
+        if (n_listeners > 1)
+            WARN("%s: one listener thread drains a shared memory ring", GLOBAL.listener->to_string);
+        listener_t *listener = &GLOBAL.listeners[0];
+        memcpy(&listener->socket, GLOBAL.listener, sizeof(relay_socket_t));
+        listener->socket.socket = -1;
+        listener->tid = 0;
+        listener->stopping = 0;
+        spawn(&listener->tid, shm_server, listener, PTHREAD_CREATE_JOINABLE);
+        GLOBAL.n_listeners = 1;
+#else
+        FATAL("%s: built without shared memory ring support", GLOBAL.listener->to_string);
+#endif
+        return;
+    }
+
+    /* A unix socket address can be bound only once, no SO_REUSEPORT. */
+    if (is_unix && n_listeners > 1) {
+        WARN("%s: unix sockets cannot be sharded, using one listener thread", GLOBAL.listener->to_string);
+        n_listeners = 1;
+    }
+
+    /* must open the sockets BEFORE we create the worker pool */
+    for (uint32_t i = 0; i < n_listeners; i++) {
+        listener_t *listener = &GLOBAL.listeners[i];
+
+        memcpy(&listener->socket, GLOBAL.listener, sizeof(relay_socket_t));
+        listener->tid = 0;
+        listener->stopping = 0;
+        listener->rxq_drops = 0;
+        listener->rxq_peak_bytes = 0;
+
+        if (!open_socket(&listener->socket, DO_BIND | DO_REUSEADDR |
 #ifdef SO_REUSEPORT
-                (GLOBAL.listener->proto == IPPROTO_TCP ? DO_REUSEPORT : 0) |
+                         (!is_unix && (listener->socket.type != SOCK_DGRAM || n_listeners > 1) ? DO_REUSEPORT : 0) |
 #endif
-                DO_EPOLLFD, 0, config->server_socket_rcvbuf_bytes);
+                         (config->udp_gro && !is_unix ? DO_UDP_GRO : 0) |
+                         (listener->socket.type == SOCK_DGRAM ? DO_RXQ_OVFL : 0) |
+                         (listener->socket.type != SOCK_DGRAM ? DO_EPOLLFD : 0), 0, config->server_socket_rcvbuf_bytes))
+            FATAL("Failed to open the listener socket %s", GLOBAL.listener->to_string);
+        attach_listener_filter(&listener->socket, config);
+    }
 
     /* create worker pool /after/ we open the socket, otherwise we
      * might leak worker threads. */
 
-    if (GLOBAL.listener->proto == IPPROTO_UDP)
-        spawn(&server_tid, udp_server, GLOBAL.listener, PTHREAD_CREATE_JOINABLE);
-    else
-        spawn(&server_tid, tcp_server, GLOBAL.listener, PTHREAD_CREATE_JOINABLE);
+    for (uint32_t i = 0; i < n_listeners; i++) {
+        listener_t *listener = &GLOBAL.listeners[i];
+        if (listener->socket.type == SOCK_DGRAM)
+            spawn(&listener->tid, udp_server, listener, PTHREAD_CREATE_JOINABLE);
+        else
+            spawn(&listener->tid, tcp_server, listener, PTHREAD_CREATE_JOINABLE);
+    }
 
-    return server_tid;
+    GLOBAL.n_listeners = n_listeners;
+
+    if (n_listeners > 1)
+        SAY("Started %u listener threads for %s", n_listeners, GLOBAL.listener->to_string);
 }
 
 static struct graphite_config *graphite_config_clone(const struct graphite_config *old_config)
@@ -615,6 +1229,8 @@ static void malloc_config(config_t * config)
 
     SAY("malloc_style: %s", config->malloc.style == SYSTEM_MALLOC ? "system" :
         config->malloc.style == JEMALLOC ? "jemalloc" : config->malloc.style == TCMALLOC ? "tcmalloc" : "unknown");
+    if (blob_pool_enabled())
+        SAY("blobs from the blob pool");
 
     config->malloc.pagesize = sysconf(_SC_PAGESIZE);
     SAY("pagesize: %ld", config->malloc.pagesize);
@@ -661,10 +1277,11 @@ static int serve(config_t * config)
     if (GLOBAL.listener == NULL)
         return EXIT_FAILURE;
 
-    pthread_t server_tid = 0;
-
+    /* before anything allocates a blob */
+    blob_pool_init(config->blob_pool);
+    memory_budget_configure(&GLOBAL.budget, config);
     worker_pool_init_static(config);
-    server_tid = setup_listener(config);
+    setup_listener(config);
     GLOBAL.graphite_worker = graphite_worker_create(config);
     pthread_create(&GLOBAL.graphite_worker->base.tid, NULL, graphite_worker_thread, GLOBAL.graphite_worker);
 
@@ -692,9 +1309,10 @@ static int serve(config_t * config)
             struct graphite_config *old_graphite_config = graphite_config_clone(&config->graphite);
             if (config_reload(config, config->config_file, time(NULL))) {
                 SAY("Reloading the listener and worker pool");
-                stop_listener(server_tid);
-                server_tid = setup_listener(config);
+                stop_listener();
+                setup_listener(config);
                 worker_pool_reload_static(config);
+                memory_budget_configure(&GLOBAL.budget, config);
                 SAY("Reloaded the listener and worker pool");
                 if (graphite_config_changed(old_graphite_config, &config->graphite)) {
                     SAY("Graphite config changed, reloading the graphite worker");
@@ -711,8 +1329,7 @@ static int serve(config_t * config)
             control_unset_bits(RELAY_RELOADING);
         }
 
-        update_process_status(process_status_buffer, config, RELAY_ATOMIC_READ(RECEIVED_STATS.received_count),
-                              RELAY_ATOMIC_READ(RECEIVED_STATS.tcp_connections));
+        update_process_status(process_status_buffer, config);
 
         sleep(1);
 
@@ -723,8 +1340,7 @@ static int serve(config_t * config)
         }
     }
 
-    update_process_status(process_status_buffer, config, RELAY_ATOMIC_READ(RECEIVED_STATS.received_count),
-                          RELAY_ATOMIC_READ(RECEIVED_STATS.tcp_connections));
+    update_process_status(process_status_buffer, config);
 
     SAY("%s", process_status_buffer->data);
     fixed_buffer_destroy(process_status_buffer);
@@ -735,7 +1351,7 @@ static int serve(config_t * config)
 
     setproctitle("stopping");
 
-    final_shutdown(server_tid);
+    final_shutdown();
 
     SAY("Unlocking %s", config->lock_file);
     if (close(lock_fd) == -1) {
@@ -775,25 +1391,68 @@ static void block_all_signals_inside_thread()
     pthread_sigmask(SIG_BLOCK, &sigs_to_block, NULL);
 }
 
-static void stop_listener(pthread_t server_tid)
+static void stop_listener(void)
 {
+    uint32_t n_listeners = GLOBAL.n_listeners;
+
+    /* The tcp sockets are closed only after their reactor has exited:
+     * closing a socket silently drops it from the epoll set, so the
+     * reactor might never hear of it.  The shut down listening socket
+     * stays readable instead, and the accept() on it fails. */
+    int is_tcp = GLOBAL.listener && GLOBAL.listener->type != SOCK_DGRAM;
+
+    /* The shm listener has no socket, it notices the stopping by itself. */
+    if (GLOBAL.listener && GLOBAL.listener->proto == SOCK_FAKE_SHM) {
+        for (uint32_t i = 0; i < n_listeners; i++) {
+            RELAY_ATOMIC_OR(GLOBAL.listeners[i].stopping, WORKER_STOPPING);
+            pthread_join(GLOBAL.listeners[i].tid, NULL);
+            GLOBAL.listeners[i].tid = 0;
+        }
+        GLOBAL.n_listeners = 0;
+        return;
+    }
+
+    /* No more sampling of the sockets by listener_stats_sum(),
+     * their final kernel drops move into the counters. */
+    RELAY_ATOMIC_AND(GLOBAL.n_listeners, 0);
+
     if (GLOBAL.listener) {
-        shutdown(GLOBAL.listener->socket, SHUT_RDWR);
-        /* TODO: if the relay is interrupted rudely (^C), final_shutdown()
-         * is called, which will call stop_listener(), and this close()
-         * triggers the ire of the clang threadsanitizer, since the socket
-         * was opened by a worker thread with a recv() in udp_server, but
-         * the shutdown happens in the main thread. */
-        close(GLOBAL.listener->socket);
+        for (uint32_t i = 0; i < n_listeners; i++) {
+            listener_t *listener = &GLOBAL.listeners[i];
+            RELAY_ATOMIC_INCREMENT(listener->counters.kernel_drops, listener_socket_drops(listener));
+            RELAY_ATOMIC_OR(GLOBAL.listeners[i].stopping, WORKER_STOPPING);
+            shutdown(GLOBAL.listeners[i].socket.socket, SHUT_RDWR);
+            /* TODO: if the relay is interrupted rudely (^C), final_shutdown()
+             * is called, which will call stop_listener(), and this close()
+             * triggers the ire of the clang threadsanitizer, since the socket
+             * was opened by a worker thread with a recv() in udp_server, but
+             * the shutdown happens in the main thread. */
+            if (!is_tcp)
+                close(GLOBAL.listeners[i].socket.socket);
+        }
+    }
+    for (uint32_t i = 0; i < n_listeners; i++) {
+        if (GLOBAL.listeners[i].tid)
+            pthread_join(GLOBAL.listeners[i].tid, NULL);
+        GLOBAL.listeners[i].tid = 0;
+        RELAY_ATOMIC_INCREMENT(GLOBAL.listeners[i].counters.rxq_drops, GLOBAL.listeners[i].rxq_drops);
+        GLOBAL.listeners[i].rxq_drops = 0;
+        if (is_tcp)
+            close(GLOBAL.listeners[i].socket.socket);
+    }
+    if (n_listeners && GLOBAL.listener->sa.un.sun_family == AF_UNIX && GLOBAL.listener->sa.un.sun_path[0]) {
+        /* as in open_socket(), only a socket is ever removed */
+        struct stat st;
+        if (lstat(GLOBAL.listener->sa.un.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(GLOBAL.listener->sa.un.sun_path);
     }
-    if (server_tid)
-        pthread_join(server_tid, NULL);
+    GLOBAL.n_listeners = 0;
 }
 
-static void final_shutdown(pthread_t server_tid)
+static void final_shutdown(void)
 {
     /* Stop accepting more traffic. */
-    stop_listener(server_tid);
+    stop_listener();
     free(GLOBAL.listener);
     GLOBAL.listener = NULL;
 
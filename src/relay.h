@@ -8,6 +8,41 @@
 #include <unistd.h>
 
 #include "relay_common.h"
+#include "relay_threads.h"
 #include "socket_util.h"
+#include "stats.h"
+
+#define MAX_LISTENER_THREADS 64
+
+/* A listener thread and its socket.  With more than one listener
+ * thread each has its own SO_REUSEPORT socket for the same address,
+ * and for tcp also its own client connections. */
+struct listener {
+    relay_socket_t socket;
+    pthread_t tid;
+
+    /* If non-zero, the listener is being stopped.  Needed by the
+     * io_uring receive, which the socket being closed does not end. */
+    volatile uint32_t stopping;
+
+    /* The drop count that came with the latest datagram (SO_RXQ_OVFL). */
+    volatile uint32_t rxq_drops;
+    /* The most bytes seen queued on the socket since the last
+     * listener_queue_peak(), sampled when a receive batch came back full. */
+    volatile uint32_t rxq_peak_bytes;
+
+    /* Only received_count, recv_call_count, kernel_drops, rxq_drops, and
+     * the tcp_ counters are used.  These survive reloads, so that the totals
+     * keep growing. */
+    stats_basic_counters_t counters;
+};
+typedef struct listener listener_t;
+
+/* Sums up the counters of all the listener threads.  The kernel_drops
+ * and the rxq_ counters include those of the open datagram sockets. */
+void listener_stats_sum(stats_basic_counters_t * sum);
+
+/* Returns the most bytes queued on a listener socket since the previous call. */
+uint32_t listener_queue_peak(void);
 
 #endif                          /* #ifndef RELAY_RELAY_H */
@@ -9,4 +9,10 @@
 #define LOCK_INIT(x) pthread_mutex_init(x, NULL)
 #define LOCK_DESTROY(x) pthread_mutex_destroy(x)
 
+#define RWLOCK_T pthread_rwlock_t
+#define RDLOCK(x) if (x) pthread_rwlock_rdlock(x)
+#define WRLOCK(x) if (x) pthread_rwlock_wrlock(x)
+#define RWUNLOCK(x) if (x) pthread_rwlock_unlock(x)
+#define RWLOCK_INIT(x) pthread_rwlock_init(x, NULL)
+
 #endif                          /* #ifndef RELAY_RELAY_THREADS_H */
@@ -0,0 +1,329 @@
+#include "shm_ring.h"
+
+#ifdef HAVE_SHM_RING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SHM_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+/* Not FUTEX_PRIVATE_FLAG: the waiter and the wakers are different processes. */
+static int futex_wait(volatile uint32_t * addr, uint32_t val, unsigned timeout_millisec)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout_millisec / 1000;
+    ts.tv_nsec = (timeout_millisec % 1000) * 1000000L;
+    return (int) syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static int futex_wake(volatile uint32_t * addr)
+{
+    return (int) syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static int shm_ring_name_set(shm_ring_t * ring, const char *name)
+{
+    int wrote = snprintf(ring->name, sizeof(ring->name), "%s", name);
+    if (wrote < 0 || (size_t) wrote >= sizeof(ring->name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int shm_ring_map(shm_ring_t * ring, size_t map_size)
+{
+    void *p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (p == MAP_FAILED)
+        return -1;
+
+    ring->map_size = map_size;
+    ring->hdr = (struct shm_ring_header *) p;
+    ring->data = (unsigned char *) p + SHM_RING_HEADER_SIZE;
+    ring->mask = map_size - SHM_RING_HEADER_SIZE - 1;
+    return 0;
+}
+
+static void shm_ring_unmap(shm_ring_t * ring)
+{
+    if (ring->hdr)
+        munmap(ring->hdr, ring->map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->hdr = NULL;
+    ring->data = NULL;
+    ring->fd = -1;
+}
+
+/* The ring positions grow forever, only their low bits index the data. */
+static void shm_ring_copy_in(shm_ring_t * ring, uint64_t pos, const void *src, size_t len)
+{
+    size_t offset = pos & ring->mask;
+    size_t first = ring->mask + 1 - offset;
+
+    if (first >= len) {
+        memcpy(ring->data + offset, src, len);
+    } else {
+        memcpy(ring->data + offset, src, first);
+        memcpy(ring->data, (const unsigned char *) src + first, len - first);
+    }
+}
+
+static void shm_ring_copy_out(shm_ring_t * ring, uint64_t pos, void *dst, size_t len)
+{
+    size_t offset = pos & ring->mask;
+    size_t first = ring->mask + 1 - offset;
+
+    if (first >= len) {
+        memcpy(dst, ring->data + offset, len);
+    } else {
+        memcpy(dst, ring->data + offset, first);
+        memcpy((unsigned char *) dst + first, ring->data, len - first);
+    }
+}
+
+int shm_ring_create(shm_ring_t * ring, const char *name, uint64_t size)
+{
+    pthread_mutexattr_t attr;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    if (size < SHM_RING_HEADER_SIZE || (size & (size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (shm_ring_name_set(ring, name))
+        return -1;
+
+    /* A ring left over by a relay that did not exit cleanly. */
+    if (shm_unlink(name) && errno != ENOENT)
+        return -1;
+
+    ring->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (ring->fd < 0)
+        return -1;
+
+    if (ftruncate(ring->fd, SHM_RING_HEADER_SIZE + size) || shm_ring_map(ring, SHM_RING_HEADER_SIZE + size))
+        goto fail;
+
+    struct shm_ring_header *hdr = ring->hdr;
+    hdr->version = SHM_RING_VERSION;
+    hdr->size = size;
+
+    /* Robust, so that a producer dying in the middle of a send
+     * does not leave the lock held forever. */
+    if (pthread_mutexattr_init(&attr))
+        goto fail;
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int rc = pthread_mutex_init(&hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc) {
+        errno = rc;
+        goto fail;
+    }
+
+    SHM_STORE_RELEASE(&hdr->magic, SHM_RING_MAGIC);
+    return 0;
+
+  fail:
+    {
+        int saved_errno = errno;
+        shm_ring_unmap(ring);
+        shm_unlink(name);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+void shm_ring_destroy(shm_ring_t * ring)
+{
+    if (ring->hdr)
+        SHM_STORE_RELEASE(&ring->hdr->closed, 1);
+    shm_unlink(ring->name);
+    shm_ring_unmap(ring);
+}
+
+int shm_ring_next(shm_ring_t * ring, uint32_t * size)
+{
+    uint64_t avail = SHM_LOAD_ACQUIRE(&ring->hdr->head) - ring->tail;
+    unsigned char header[SHM_RING_FRAME_HEADER_SIZE];
+
+    if (avail == 0)
+        return 0;
+
+    /* The head only ever moves past complete frames. */
+    if (avail < SHM_RING_FRAME_HEADER_SIZE || avail > ring->mask + 1)
+        return -1;
+
+    shm_ring_copy_out(ring, ring->tail, header, SHM_RING_FRAME_HEADER_SIZE);
+    *size = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t) header[3] << 24;
+    if (*size > avail - SHM_RING_FRAME_HEADER_SIZE)
+        return -1;
+
+    return 1;
+}
+
+void shm_ring_read(shm_ring_t * ring, void *dst, uint32_t size)
+{
+    shm_ring_copy_out(ring, ring->tail + SHM_RING_FRAME_HEADER_SIZE, dst, size);
+    ring->tail += SHM_RING_FRAME_HEADER_SIZE + size;
+}
+
+void shm_ring_release(shm_ring_t * ring)
+{
+    SHM_STORE_RELEASE(&ring->hdr->tail, ring->tail);
+}
+
+void shm_ring_reset(shm_ring_t * ring)
+{
+    ring->tail = SHM_LOAD_ACQUIRE(&ring->hdr->head);
+    shm_ring_release(ring);
+}
+
+/* How long to poll the head before going to sleep: a busy producer
+ * should not have to pay for a futex wake after every frame. */
+#define SHM_RING_SPIN 4096
+
+int shm_ring_wait(shm_ring_t * ring, unsigned timeout_millisec)
+{
+    struct shm_ring_header *hdr = ring->hdr;
+
+    for (int i = 0; i < SHM_RING_SPIN; i++) {
+        if (SHM_LOAD_ACQUIRE(&hdr->head) != ring->tail)
+            return 1;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    uint32_t doorbell = __atomic_load_n(&hdr->doorbell, __ATOMIC_SEQ_CST);
+
+    /* Announce the sleep before the last look at the head: a producer
+     * either sees the flag and wakes us, or we see its frame. */
+    __atomic_store_n(&hdr->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) == ring->tail)
+        futex_wait(&hdr->doorbell, doorbell, timeout_millisec);
+    __atomic_store_n(&hdr->sleeping, 0, __ATOMIC_SEQ_CST);
+
+    return SHM_LOAD_ACQUIRE(&hdr->head) != ring->tail;
+}
+
+int shm_ring_open(shm_ring_t * ring, const char *name)
+{
+    struct stat st;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    if (shm_ring_name_set(ring, name))
+        return -1;
+
+    ring->fd = shm_open(name, O_RDWR, 0);
+    if (ring->fd < 0)
+        return -1;
+
+    if (fstat(ring->fd, &st))
+        goto fail;
+    if ((size_t) st.st_size <= SHM_RING_HEADER_SIZE) {
+        /* Not yet sized by the relay. */
+        errno = EAGAIN;
+        goto fail;
+    }
+    if (shm_ring_map(ring, st.st_size))
+        goto fail;
+
+    struct shm_ring_header *hdr = ring->hdr;
+    if (SHM_LOAD_ACQUIRE(&hdr->magic) != SHM_RING_MAGIC) {
+        errno = EAGAIN;
+        goto fail;
+    }
+    if (hdr->version != SHM_RING_VERSION || SHM_RING_HEADER_SIZE + hdr->size != (uint64_t) st.st_size) {
+        errno = EPROTO;
+        goto fail;
+    }
+
+    return 0;
+
+  fail:
+    {
+        int saved_errno = errno;
+        shm_ring_unmap(ring);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+int shm_ring_send(shm_ring_t * ring, const void *data, uint32_t size)
+{
+    struct shm_ring_header *hdr = ring->hdr;
+
+    if (hdr == NULL || SHM_LOAD_ACQUIRE(&hdr->closed)) {
+        char name[sizeof(ring->name)];
+        memcpy(name, ring->name, sizeof(name));
+        shm_ring_close(ring);
+        if (shm_ring_open(ring, name))
+            return -1;
+        hdr = ring->hdr;
+    }
+
+    uint64_t need = SHM_RING_FRAME_HEADER_SIZE + (uint64_t) size;
+    if (need > ring->mask + 1) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    int rc = pthread_mutex_lock(&hdr->lock);
+    if (rc == EOWNERDEAD) {
+        /* The head is moved only after a complete frame,
+         * so whatever the dead producer left half-written
+         * is simply overwritten. */
+        pthread_mutex_consistent(&hdr->lock);
+    } else if (rc) {
+        errno = rc;
+        return -1;
+    }
+
+    uint64_t head = hdr->head;
+    if (need > ring->mask + 1 - (head - SHM_LOAD_ACQUIRE(&hdr->tail))) {
+        __atomic_add_fetch(&hdr->dropped, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&hdr->lock);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    unsigned char header[SHM_RING_FRAME_HEADER_SIZE];
+    header[0] = size & 0xFF;
+    header[1] = (size >> 8) & 0xFF;
+    header[2] = (size >> 16) & 0xFF;
+    header[3] = (size >> 24) & 0xFF;
+    shm_ring_copy_in(ring, head, header, SHM_RING_FRAME_HEADER_SIZE);
+    shm_ring_copy_in(ring, head + SHM_RING_FRAME_HEADER_SIZE, data, size);
+
+    SHM_STORE_RELEASE(&hdr->head, head + need);
+    pthread_mutex_unlock(&hdr->lock);
+
+    /* See shm_ring_wait(). */
+    __atomic_add_fetch(&hdr->doorbell, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hdr->sleeping, __ATOMIC_SEQ_CST))
+        futex_wake(&hdr->doorbell);
+
+    return 0;
+}
+
+void shm_ring_close(shm_ring_t * ring)
+{
+    shm_ring_unmap(ring);
+}
+
+#endif                          /* #ifdef HAVE_SHM_RING */
@@ -0,0 +1,107 @@
+#ifndef RELAY_SHM_RING_H
+#define RELAY_SHM_RING_H
+
+/* A shared memory ring for the producers on the same host: the relay
+ * creates it (listener shm@/name), the producers write frames into it
+ * without a system call, and ring a futex doorbell only if the relay
+ * is asleep.
+ *
+ * The frames are framed as on tcp: a four byte little-endian length,
+ * then the payload.  The frames wrap around the end of the ring.
+ *
+ * The producers serialize on a process-shared robust mutex, and a full
+ * ring makes shm_ring_send() fail with EAGAIN rather than wait, just as
+ * a full socket buffer would drop a datagram.
+ *
+ * This file and shm_ring.c do not depend on the rest of the relay,
+ * "make shm_lib" builds them into bin/librelay_shm.a for the producers:
+ *
+ *     shm_ring_t ring;
+ *     if (shm_ring_open(&ring, "/events") == 0) {
+ *         shm_ring_send(&ring, data, size);
+ *         shm_ring_close(&ring);
+ *     }
+ *
+ * Linux only, built with HAVE_SHM_RING. */
+
+#ifdef HAVE_SHM_RING
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHM_RING_MAGIC 0x52534852       /* "RHSR" */
+#define SHM_RING_VERSION 1
+
+/* The data follows the header at this offset. */
+#define SHM_RING_HEADER_SIZE 4096
+
+#define SHM_RING_FRAME_HEADER_SIZE 4
+
+#define SHM_RING_ALIGNED __attribute__ ((aligned(64)))
+
+struct shm_ring_header {
+    /* Written last by the relay, once the rest is ready. */
+    uint32_t magic;
+    uint32_t version;
+    /* The size of the data area, a power of two. */
+    uint64_t size;
+    /* Set by the relay when it goes away, the producers should reopen. */
+    volatile uint32_t closed;
+
+    pthread_mutex_t lock;
+
+    /* Where the producers write next, moved only under the lock. */
+    volatile uint64_t head SHM_RING_ALIGNED;
+    /* The frames the producers had no room for. */
+    volatile uint64_t dropped;
+
+    /* Where the relay reads next. */
+    volatile uint64_t tail SHM_RING_ALIGNED;
+
+    /* Bumped by every send, waited on by the relay when sleeping is set. */
+    volatile uint32_t doorbell SHM_RING_ALIGNED;
+    volatile uint32_t sleeping;
+};
+
+struct shm_ring {
+    int fd;
+    struct shm_ring_header *hdr;
+    unsigned char *data;
+    uint64_t mask;
+    size_t map_size;
+    /* The relay's read cursor, published to hdr->tail by shm_ring_release(). */
+    uint64_t tail;
+    char name[256];
+};
+typedef struct shm_ring shm_ring_t;
+
+/* The relay side.  The size must be a power of two.
+ * Return 0 on success, -1 with errno set on failure. */
+int shm_ring_create(shm_ring_t * ring, const char *name, uint64_t size);
+void shm_ring_destroy(shm_ring_t * ring);
+
+/* Returns 1 if a complete frame is waiting, and its payload size,
+ * 0 if there is none, and -1 if the ring is corrupt. */
+int shm_ring_next(shm_ring_t * ring, uint32_t * size);
+/* Copies out the payload of the frame shm_ring_next() found. */
+void shm_ring_read(shm_ring_t * ring, void *dst, uint32_t size);
+/* Hands the space of the frames read so far back to the producers. */
+void shm_ring_release(shm_ring_t * ring);
+/* Drops everything written so far, after shm_ring_next() found garbage. */
+void shm_ring_reset(shm_ring_t * ring);
+/* Waits for the doorbell at most timeout_millisec,
+ * returns 1 if there may be frames to read. */
+int shm_ring_wait(shm_ring_t * ring, unsigned timeout_millisec);
+
+/* The producer side.  Return 0 on success, -1 with errno set on failure.
+ * shm_ring_send() fails with EAGAIN if the ring is full, with EMSGSIZE
+ * if the frame could never fit, and reopens the ring by name if the
+ * relay has recreated it. */
+int shm_ring_open(shm_ring_t * ring, const char *name);
+int shm_ring_send(shm_ring_t * ring, const void *data, uint32_t size);
+void shm_ring_close(shm_ring_t * ring);
+
+#endif                          /* #ifdef HAVE_SHM_RING */
+
+#endif                          /* #ifndef RELAY_SHM_RING_H */
@@ -2,6 +2,11 @@
 
 #include <ctype.h>
 #include <libgen.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#ifdef SO_ATTACH_FILTER
+#include <linux/filter.h>
+#endif
 
 #include "global.h"
 #include "log.h"
@@ -9,12 +14,101 @@
 
 #define DEBUG_SOCKETIZE 0
 
+/* The unix domain socket endpoints, the type is implied by the prefix. */
+static const struct {
+    const char *prefix;
+    int type;
+} unix_endpoints[] = {
+    {"unix@", SOCK_STREAM},
+    {"unixgram@", SOCK_DGRAM},
+    {"unixpacket@", SOCK_SEQPACKET},
+};
+
+/* Parse a unix domain socket endpoint: the path follows the prefix, and a
+ * path starting with '@' names a socket in the abstract namespace.
+ * Returns 1 if the argument was a unix endpoint, 0 if not, and -1 if it
+ * was one but it is invalid. */
+static int socketize_unix(const char *arg, relay_socket_t * s)
+{
+    for (size_t i = 0; i < sizeof(unix_endpoints) / sizeof(unix_endpoints[0]); i++) {
+        size_t prefix_len = strlen(unix_endpoints[i].prefix);
+        if (strncmp(arg, unix_endpoints[i].prefix, prefix_len))
+            continue;
+
+        const char *path = arg + prefix_len;
+        size_t path_len = strlen(path);
+        int abstract = *path == '@';
+
+        if (path_len == 0 || (abstract && path_len == 1)) {
+            WARN("Missing unix socket path in '%s'", arg);
+            return -1;
+        }
+        /* The abstract names are not nul-terminated, the paths are. */
+        if (path_len + !abstract > sizeof(s->sa.un.sun_path)) {
+            WARN("Unix socket path too long in '%s'", arg);
+            return -1;
+        }
+
+        memset(&s->sa.un, 0, sizeof(s->sa.un));
+        s->sa.un.sun_family = AF_UNIX;
+        if (abstract) {
+            /* The leading nul marks the abstract namespace. */
+            memcpy(s->sa.un.sun_path + 1, path + 1, path_len - 1);
+        } else {
+            memcpy(s->sa.un.sun_path, path, path_len);
+        }
+        s->addrlen = offsetof(struct sockaddr_un, sun_path) + path_len + !abstract;
+        s->type = unix_endpoints[i].type;
+
+        int wrote = snprintf(s->to_string, PATH_MAX, "%s", arg);
+        if (wrote < 0 || wrote >= PATH_MAX) {
+            WARN("Failed to stringify target descriptor");
+            return -1;
+        }
+        if (DEBUG_SOCKETIZE)
+            SAY("socket details: %s", s->to_string);
+        return 1;
+    }
+    return 0;
+}
+
 static int socketize_validate(const char *arg, char *a, relay_socket_t * s, int default_proto, int connection_direction)
 {
     char *p;
     int proto = SOCK_FAKE_ERROR;
     int wrote = 0;
 
+    if (strncmp(arg, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+        const char *name = arg + strlen(SHM_PREFIX);
+        if (connection_direction != RELAY_CONN_IS_INBOUND) {
+            WARN("Shared memory rings are only for the listener, not '%s'", arg);
+            return 0;
+        }
+        /* The shm_open() names are a slash and a filename. */
+        if (name[0] != '/' || name[1] == 0 || strchr(name + 1, '/')) {
+            WARN("Invalid shared memory ring name in '%s', expected shm@/name", arg);
+            return 0;
+        }
+        wrote = snprintf(s->to_string, PATH_MAX, "%s", arg);
+        if (wrote < 0 || wrote >= PATH_MAX) {
+            WARN("Failed to stringify target descriptor");
+            return 0;
+        }
+        memset(&s->sa, 0, sizeof(s->sa));
+        s->proto = SOCK_FAKE_SHM;
+        s->type = 0;
+        return 1;
+    }
+
+    /* Before looking for a port: the paths may contain colons. */
+    int is_unix = socketize_unix(arg, s);
+    if (is_unix < 0)
+        return 0;
+    if (is_unix) {
+        s->proto = 0;
+        return 1;
+    }
+
     if ((p = strchr(a, ':')) != NULL) {
 
         s->sa.in.sin_family = AF_INET;
@@ -179,6 +273,23 @@ int open_socket(relay_socket_t * s, int flags, socklen_t snd, socklen_t rcv)
             WARN("SO_REUSEPORT requested but not implemented");
 #endif
         }
+        if (s->sa.un.sun_family == AF_UNIX && s->sa.un.sun_path[0]) {
+            /* A socket file left over from a previous listener would
+             * make the bind fail.  (The abstract names go away with
+             * their sockets.)  Anything else at the path is left alone,
+             * a typo in the config must not remove someone's file. */
+            struct stat st;
+            if (lstat(s->sa.un.sun_path, &st) == 0) {
+                if (!S_ISSOCK(st.st_mode)) {
+                    errno = EEXIST;
+                    WARN_CLOSE_FAIL(s, "bind[%s]: %s exists and is not a socket", s->to_string, s->sa.un.sun_path);
+                }
+                if (unlink(s->sa.un.sun_path))
+                    WARN_CLOSE_FAIL(s, "unlink[%s]", s->to_string);
+            } else if (errno != ENOENT) {
+                WARN_CLOSE_FAIL(s, "lstat[%s]", s->to_string);
+            }
+        }
         time_t last_addrinuse = 0;
         for (;;) {
             errno = 0;
@@ -204,12 +315,40 @@ int open_socket(relay_socket_t * s, int flags, socklen_t snd, socklen_t rcv)
             }
             WARN_CLOSE_FAIL(s, "bind[%s]", s->to_string);
         }
-        if (s->proto == IPPROTO_TCP) {
+        if (s->type != SOCK_DGRAM) {
             if (listen(s->socket, SOMAXCONN))
                 WARN_CLOSE_FAIL(s, "listen[%s]", s->to_string);
         }
+        if (flags & DO_EPOLLFD) {
+            /* The socket will be driven by an epoll reactor. */
+            if (setnonblocking(s->socket) == -1)
+                WARN_CLOSE_FAIL(s, "setnonblocking[%s]", s->to_string);
+        }
+        if ((flags & DO_UDP_GRO) && s->proto == IPPROTO_UDP) {
+#ifdef UDP_GRO
+            /* Not fatal: without it we just receive the datagrams one by one. */
+            int optval = 1;
+            if (setsockopt(s->socket, IPPROTO_UDP, UDP_GRO, &optval, sizeof(optval))) {
+                WARN_ERRNO("setsockopt[%s, UDP_GRO, 1]", s->to_string);
+            } else {
+                SAY("%s UDP_GRO on", s->to_string);
+            }
+#else
+            WARN("UDP_GRO requested but not implemented");
+#endif
+        }
+        if (flags & DO_RXQ_OVFL) {
+#ifdef SO_RXQ_OVFL
+            /* Not fatal either, only the drop counts are missed. */
+            int optval = 1;
+            if (setsockopt(s->socket, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval)))
+                WARN_ERRNO("setsockopt[%s, SO_RXQ_OVFL, 1]", s->to_string);
+#endif
+        }
     } else if (flags & DO_CONNECT) {
-        if (s->proto == IPPROTO_TCP) {
+        /* The datagrams are sent with sendto(), so only the
+         * connection-oriented sockets need connecting. */
+        if (s->type != SOCK_DGRAM) {
             if (connect(s->socket, (struct sockaddr *) &s->sa.in, s->addrlen))
                 WARN_CLOSE_FAIL(s, "connect[%s]", s->to_string);
             if (GLOBAL.config->tcp_send_timeout_millisec > 0) {
@@ -259,3 +398,98 @@ int setnonblocking(int fd)
     flags |= O_NONBLOCK;
     return fcntl(fd, F_SETFL, flags);
 }
+
+#ifdef SO_ATTACH_FILTER
+/* A jump target placeholder, patched to point to the final "drop". */
+#define FILTER_DROP 0xFF
+
+/* Build a classic BPF program: load the length and compare it with the
+ * limits, load the prefix a word (or a byte) at a time and compare it,
+ * accept if everything matched, drop otherwise.  A load beyond the end
+ * of the packet drops it too, so short packets never match the prefix. */
+static int listener_filter_build(struct sock_filter *prog, uint32_t offset, uint32_t min_bytes,
+                                 uint32_t max_bytes, const unsigned char *prefix, size_t prefix_len)
+{
+    int n = 0;
+
+    if (min_bytes || max_bytes)
+        prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+    if (min_bytes)
+        prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, offset + min_bytes, 0, FILTER_DROP);
+    if (max_bytes)
+        prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, offset + max_bytes, FILTER_DROP, 0);
+
+    for (size_t i = 0; i < prefix_len;) {
+        const unsigned char *p = prefix + i;
+        if (prefix_len - i >= 4) {
+            /* The word loads are big-endian. */
+            uint32_t word = (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+            prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offset + i);
+            prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, word, 0, FILTER_DROP);
+            i += 4;
+        } else {
+            prog[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offset + i);
+            prog[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, p[0], 0, FILTER_DROP);
+            i += 1;
+        }
+    }
+
+    prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+    int drop = n;
+    prog[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+
+    for (int i = 0; i < drop; i++) {
+        if (BPF_CLASS(prog[i].code) != BPF_JMP)
+            continue;
+        if (prog[i].jt == FILTER_DROP)
+            prog[i].jt = drop - i - 1;
+        if (prog[i].jf == FILTER_DROP)
+            prog[i].jf = drop - i - 1;
+    }
+
+    return n;
+}
+#endif                          /* #ifdef SO_ATTACH_FILTER */
+
+int attach_listener_filter(relay_socket_t * s, const config_t * config)
+{
+    unsigned char prefix[MAX_LISTENER_FILTER_PREFIX];
+    ssize_t prefix_len = hex_decode(config->listener_filter_prefix, prefix, sizeof(prefix));
+    uint32_t min_bytes = config->listener_filter_min_bytes;
+    uint32_t max_bytes = config->listener_filter_max_bytes;
+
+    if (prefix_len <= 0 && !min_bytes && !max_bytes)
+        return 1;
+
+    if (s->type != SOCK_DGRAM) {
+        WARN("%s: the listener filter applies only to datagrams, not using it", s->to_string);
+        return 1;
+    }
+    /* For udp the packet starts with the udp header. */
+    uint32_t offset = s->sa.in.sin_family == AF_INET ? sizeof(struct udphdr) : 0;
+
+    if (max_bytes && config->udp_gro && s->sa.in.sin_family == AF_INET) {
+        /* The filter sees the coalesced datagrams. */
+        WARN("%s: listener_filter_max_bytes does not work with udp_gro, not using it", s->to_string);
+        max_bytes = 0;
+    }
+#ifdef SO_ATTACH_FILTER
+    /* The length check, the prefix compares, accept, drop. */
+    struct sock_filter prog[3 + 2 * MAX_LISTENER_FILTER_PREFIX + 2];
+    struct sock_fprog fprog;
+
+    fprog.len = listener_filter_build(prog, offset, min_bytes, max_bytes, prefix, prefix_len > 0 ? prefix_len : 0);
+    fprog.filter = prog;
+    if (setsockopt(s->socket, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog))) {
+        WARN_ERRNO("setsockopt[%s, SO_ATTACH_FILTER]", s->to_string);
+        return 0;
+    }
+    SAY("%s: filtering datagrams, min %u max %u prefix '%s'", s->to_string, min_bytes, max_bytes,
+        config->listener_filter_prefix);
+    return 1;
+#else
+    (void) offset;
+    WARN("%s: socket filters not available, not filtering", s->to_string);
+    return 1;
+#endif
+}
@@ -7,6 +7,7 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,9 +28,14 @@
 #define DO_REUSEADDR    0x04
 #define DO_EPOLLFD      0x08
 #define DO_REUSEPORT    0x10
+#define DO_UDP_GRO      0x20
+#define DO_RXQ_OVFL     0x40
 
 #define SOCK_FAKE_FILE  -1
 #define SOCK_FAKE_ERROR -2
+#define SOCK_FAKE_SHM   -3      /* a shared memory ring, see shm_ring.h */
+
+#define SHM_PREFIX      "shm@"
 
 struct relay_socket {
     union sa {
@@ -53,4 +59,8 @@ int open_socket(relay_socket_t * s, int flags, socklen_t snd, socklen_t rcv);
 
 int setnonblocking(int fd);
 
+/* Attaches to a datagram listener socket the kernel filter described
+ * by the listener_filter_ options, if any.  Returns 0 on failure. */
+int attach_listener_filter(relay_socket_t * s, const config_t * config);
+
 #endif                          /* #ifndef RELAY_SOCKET_UTIL_H */
@@ -1,6 +1,8 @@
 #include "socket_worker.h"
 
 #include <ctype.h>
+#include <limits.h>
+#include <string.h>
 
 #if defined(__APPLE__) || defined(__MACH__)
 #include <sys/syslimits.h>
@@ -20,23 +22,14 @@
  * Or, if config has disabled spilling, the write phase will just drop them. */
 static void enqueue_queue_for_disk_writing(socket_worker_t * worker, queue_t * q)
 {
-    queue_append_tail(&worker->disk_writer->queue, q, &worker->lock);
+    mpsc_queue_append_tail(&worker->disk_writer->queue, q);
 }
 
-/* try to get the OS to send our packets more efficiently when sending via TCP. */
-static void cork(relay_socket_t * s, int flag)
+/* The blobs left our queues, sent, spilled or dropped. */
+static void worker_queue_dequeued(socket_worker_t * self, int64_t count, int64_t bytes)
 {
-    if (!s || s->proto != IPPROTO_TCP)
-        return;
-#ifdef TCP_CORK                 /* Linux */
-    if (setsockopt(s->socket, IPPROTO_TCP, TCP_CORK, (char *) &flag, sizeof(int)) < 0)
-        WARN_ERRNO("setsockopt TCP_CORK: %s", strerror(errno));
-#elif defined(TCP_NOPUSH)       /* BSD */
-    if (setsockopt(s->socket, IPPROTO_TCP, TCP_NOPUSH, (char *) &flag, sizeof(int)) < 0)
-        WARN_ERRNO("setsockopt TCP_NOPUSH: %s", strerror(errno));
-#else
-#error No TCP_CORK or TCP_NOPUSH
-#endif
+    RELAY_ATOMIC_DECREMENT(self->queued_count, count);
+    RELAY_ATOMIC_DECREMENT(self->queued_bytes, bytes);
 }
 
 /* Peels off all the blobs which have been in the input queue for longer
@@ -51,26 +44,23 @@ static void cork(relay_socket_t * s, int flag)
 static stats_count_t spill_by_age(socket_worker_t * self, int spill_enabled, queue_t * private_queue,
                                   queue_t * spill_queue, uint64_t spill_microsec, struct timeval *now)
 {
-    blob_t *cur_blob = private_queue->head;
-
-    if (!cur_blob)
-        return 0;
+    queue_cursor_t cursor;
+    uint32_t n_old = 0;
+    int64_t old_bytes = 0;
+
+    for (blob_t * cur_blob = queue_cursor_start(&cursor, private_queue);
+         cur_blob && elapsed_usec(&BLOB_RECEIVED_TIME(cur_blob), now) >= spill_microsec;
+         cur_blob = queue_cursor_next(&cursor)) {
+        n_old++;
+        old_bytes += BLOB_BUF_SIZE(cur_blob);
+    }
 
     /* If spill is disabled, this really counts the dropped packets. */
     stats_count_t spilled = 0;
 
-    if (elapsed_usec(&BLOB_RECEIVED_TIME(cur_blob), now) >= spill_microsec) {
-        spill_queue->head = cur_blob;
-        spill_queue->count = 1;
-        while (BLOB_NEXT(cur_blob)
-               && elapsed_usec(&BLOB_RECEIVED_TIME(BLOB_NEXT(cur_blob)), now) >= spill_microsec) {
-            cur_blob = BLOB_NEXT(cur_blob);
-            spill_queue->count++;
-        }
-        spill_queue->tail = cur_blob;
-        private_queue->head = BLOB_NEXT(cur_blob);
-        private_queue->count -= spill_queue->count;
-        BLOB_NEXT_set(cur_blob, NULL);
+    if (n_old) {
+        queue_split_nolock(private_queue, spill_queue, n_old);
+        worker_queue_dequeued(self, n_old, old_bytes);
 
         spilled += spill_queue->count;
 
@@ -88,23 +78,19 @@ static stats_count_t spill_by_age(socket_worker_t * self, int spill_enabled, que
 
 static stats_count_t spill_all(socket_worker_t * self, queue_t * private_queue, queue_t * spill_queue)
 {
-    blob_t *cur_blob = private_queue->head;
-
-    if (!cur_blob)
+    if (!private_queue->head)
         return 0;
 
     stats_count_t spilled = 0;
+    queue_cursor_t cursor;
+    int64_t bytes = 0;
 
-    spill_queue->head = cur_blob;
-    spill_queue->count = 1;
-    while (BLOB_NEXT(cur_blob)) {
-        cur_blob = BLOB_NEXT(cur_blob);
-        spill_queue->count++;
-    }
-    spill_queue->tail = cur_blob;
-    private_queue->head = BLOB_NEXT(cur_blob);
-    private_queue->count -= spill_queue->count;
-    BLOB_NEXT_set(cur_blob, NULL);
+    for (blob_t * cur_blob = queue_cursor_start(&cursor, private_queue); cur_blob;
+         cur_blob = queue_cursor_next(&cursor))
+        bytes += BLOB_BUF_SIZE(cur_blob);
+    worker_queue_dequeued(self, private_queue->count, bytes);
+
+    queue_hijack_nolock(private_queue, spill_queue);
 
     spilled += spill_queue->count;
 
@@ -113,29 +99,169 @@ static stats_count_t spill_all(socket_worker_t * self, queue_t * private_queue,
     return spilled;
 }
 
+/* Over the memory budget, give up early on the blobs this worker has been
+ * holding for longer than memory_budget_shed_millisec: with the spill
+ * policy they go to the disk writer like any other spill, with the
+ * drop_oldest policy they are dropped right here.
+ *
+ * Returns the number of spilled or dropped items. */
+static stats_count_t shed_by_age(socket_worker_t * self, queue_t * private_queue, queue_t * spill_queue,
+                                 struct timeval *now)
+{
+    memory_budget_t *budget = &GLOBAL.budget;
+
+    if (!memory_budget_shedding(budget) || !private_queue->head)
+        return 0;
+
+    uint64_t shed_microsec = 1000 * (uint64_t) budget->shed_millisec;
+    stats_count_t shed = 0;
+
+    if (budget->policy == MEMORY_BUDGET_SPILL) {
+        shed = spill_by_age(self, self->base.config->spill_enabled, private_queue, spill_queue, shed_microsec, now);
+        RELAY_ATOMIC_INCREMENT(budget->spilled_count, shed);
+    } else {
+        blob_t *cur_blob;
+        while ((cur_blob = queue_peek(private_queue))
+               && elapsed_usec(&BLOB_RECEIVED_TIME(cur_blob), now) >= shed_microsec) {
+            queue_shift_nolock(private_queue);
+            worker_queue_dequeued(self, 1, BLOB_BUF_SIZE(cur_blob));
+            blob_destroy(cur_blob);
+            shed++;
+        }
+        RELAY_ATOMIC_INCREMENT(self->counters.dropped_count, shed);
+        RELAY_ATOMIC_INCREMENT(budget->dropped_oldest_count, shed);
+    }
+
+    return shed;
+}
+
+/* Spill (or with drop_newest, drop) the newest blobs of the private queue,
+ * as many as it takes to get back within the queue limits, or all of them
+ * if what is still queued for us is over the limits already. */
+static stats_count_t refuse_newest(socket_worker_t * self, queue_t * private_queue, queue_t * spill_queue)
+{
+    uint32_t max_items = self->queue_max_items;
+    uint32_t max_bytes = self->queue_max_bytes;
+    int64_t over_count = max_items ? self->queued_count - max_items : 0;
+    int64_t over_bytes = max_bytes ? self->queued_bytes - max_bytes : 0;
+    queue_cursor_t cursor;
+    blob_t *cur_blob;
+    queue_t kept;
+    uint32_t keep = 0;
+    int64_t bytes = 0;
+    int64_t kept_bytes = 0;
+
+    if (over_count <= 0 && over_bytes <= 0)
+        return 0;
+
+    for (cur_blob = queue_cursor_start(&cursor, private_queue); cur_blob; cur_blob = queue_cursor_next(&cursor))
+        bytes += BLOB_BUF_SIZE(cur_blob);
+    /* keep the oldest while the rest still covers what we are over */
+    for (cur_blob = queue_cursor_start(&cursor, private_queue); cur_blob; cur_blob = queue_cursor_next(&cursor)) {
+        int64_t size = BLOB_BUF_SIZE(cur_blob);
+        if ((int64_t) private_queue->count - keep - 1 < over_count || bytes - kept_bytes - size < over_bytes)
+            break;
+        keep++;
+        kept_bytes += size;
+    }
+
+    memset(&kept, 0, sizeof(kept));
+    queue_split_nolock(private_queue, &kept, keep);
+    stats_count_t refused = private_queue->count;
+    worker_queue_dequeued(self, refused, bytes - kept_bytes);
+
+    if (self->queue_policy == MEMORY_BUDGET_SPILL) {
+        if (self->base.config->spill_enabled) {
+            RELAY_ATOMIC_INCREMENT(self->counters.spilled_count, refused);
+        } else {
+            RELAY_ATOMIC_INCREMENT(self->counters.dropped_count, refused);
+        }
+        queue_hijack_nolock(private_queue, spill_queue);
+        enqueue_queue_for_disk_writing(self, spill_queue);
+    } else {
+        RELAY_ATOMIC_INCREMENT(self->counters.dropped_count, refused);
+        while ((cur_blob = queue_shift_nolock(private_queue)))
+            blob_destroy(cur_blob);
+    }
+    queue_hijack_nolock(&kept, private_queue);
+
+    return refused;
+}
+
+/* Over the queue limits, with the drop_oldest worker_queue_policy drop the
+ * oldest blobs until back within them.  With the other policies the
+ * enqueuers refuse the batches which would take us over them, but a batch
+ * appended to the fanout log is counted for every worker: refuse the
+ * newest blobs here instead, just as the enqueuers would have.  Returns
+ * the number spilled or dropped. */
+static stats_count_t trim_queue(socket_worker_t * self, queue_t * private_queue, queue_t * spill_queue)
+{
+    stats_count_t dropped = 0;
+    blob_t *cur_blob;
+
+    if (self->queue_policy != MEMORY_BUDGET_DROP_OLDEST)
+        return refuse_newest(self, private_queue, spill_queue);
+
+    while (worker_queue_full(self, 0, 0) && (cur_blob = queue_shift_nolock(private_queue))) {
+        worker_queue_dequeued(self, 1, BLOB_BUF_SIZE(cur_blob));
+        blob_destroy(cur_blob);
+        dropped++;
+    }
+    if (dropped) {
+        RELAY_ATOMIC_INCREMENT(self->counters.dropped_count, dropped);
+    }
+
+    return dropped;
+}
+
+/* Append what has been queued for us to the private queue: the fanout log
+ * first, anything cloned is newer.  Returns the number of items taken. */
+static uint32_t hijack_queues(socket_worker_t * self, queue_t * private_queue)
+{
+    uint32_t hijacked = 0;
+    queue_t cloned;
+
+    if (self->fanout_reader)
+        hijacked += fanout_log_hijack(GLOBAL.pool.fanout_log, self->fanout_reader, private_queue);
+    if (mpsc_queue_hijack(&self->queue, &cloned)) {
+        hijacked += cloned.count;
+        queue_append_tail_nolock(private_queue, &cloned);
+    }
+
+    return hijacked;
+}
+
+/* While we are diverted the enqueuers spill for us, but what they queued
+ * before they noticed still reaches our queues: spill that too. */
+static void divert_queues(socket_worker_t * self, queue_t * private_queue, queue_t * spill_queue)
+{
+    hijack_queues(self, private_queue);
+    stats_count_t spilled = spill_all(self, private_queue, spill_queue);
+    if (!spilled)
+        return;
+    if (self->base.config->spill_enabled) {
+        RELAY_ATOMIC_INCREMENT(self->counters.spilled_count, spilled);
+    } else {
+        RELAY_ATOMIC_INCREMENT(self->counters.dropped_count, spilled);
+    }
+}
+
 static void connected_inc()
 {
-    LOCK(&GLOBAL.pool.lock);
-    GLOBAL.pool.n_connected++;
-    SAY("Connected count %d", GLOBAL.pool.n_connected);
-    UNLOCK(&GLOBAL.pool.lock);
+    int n_connected = RELAY_ATOMIC_INCREMENT(GLOBAL.pool.n_connected, 1);
+    SAY("Connected count %d", n_connected + 1);
 }
 
 static void connected_dec()
 {
-    LOCK(&GLOBAL.pool.lock);
-    GLOBAL.pool.n_connected--;
-    SAY("Connected count %d", GLOBAL.pool.n_connected);
-    UNLOCK(&GLOBAL.pool.lock);
+    int n_connected = RELAY_ATOMIC_DECREMENT(GLOBAL.pool.n_connected, 1);
+    SAY("Connected count %d", n_connected - 1);
 }
 
+/* called for every blob, so no locking */
 static int connected_all()
 {
-    int ret;
-    LOCK(&GLOBAL.pool.lock);
-    ret = GLOBAL.pool.n_connected == GLOBAL.pool.n_workers;
-    UNLOCK(&GLOBAL.pool.lock);
-    return ret;
+    return RELAY_ATOMIC_READ(GLOBAL.pool.n_connected) == RELAY_ATOMIC_READ(GLOBAL.pool.n_workers);
 }
 
 static void peek_send(relay_socket_t * sck, const void *data, ssize_t blob_left, ssize_t sent)
@@ -157,6 +283,173 @@ static void peek_send(relay_socket_t * sck, const void *data, ssize_t blob_left,
     errno = saverrno;
 }
 
+#ifdef HAVE_IO_URING
+/* Send the datagrams at the head of the queue, up to URING_SEND_BATCH
+ * of them, with one io_uring submission.  The sent blobs are destroyed,
+ * the ones that failed are left at the head of the queue.
+ * Returns the errno of the first failure, or zero if none failed. */
+static int uring_send_batch(socket_worker_t * self, relay_socket_t * sck, queue_t * private_queue, ssize_t * wrote)
+{
+    struct msghdr *msgs = self->uring_msgs;
+    struct iovec *iovs = self->uring_iovs;
+    int results[URING_SEND_BATCH];
+    uint32_t n = 0;
+    queue_cursor_t cursor;
+
+    for (blob_t * b = queue_cursor_start(&cursor, private_queue); b && n < URING_SEND_BATCH;
+         b = queue_cursor_next(&cursor)) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&self->ring);
+        if (!sqe)
+            break;
+        iovs[n].iov_base = BLOB_BUF_addr(b);
+        iovs[n].iov_len = BLOB_BUF_SIZE(b);
+        memset(&msgs[n], 0, sizeof(msgs[n]));
+        msgs[n].msg_name = &sck->sa.in;
+        msgs[n].msg_namelen = sck->addrlen;
+        msgs[n].msg_iov = &iovs[n];
+        msgs[n].msg_iovlen = 1;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sck->socket;
+        sqe->addr = (uint64_t) (uintptr_t) & msgs[n];
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = n;
+        results[n] = -ECANCELED;
+        n++;
+    }
+
+    uint32_t completed = 0;
+    while (completed < n) {
+        RELAY_ATOMIC_INCREMENT(self->counters.send_call_count, 1);
+        if (uring_submit_and_wait(&self->ring, n - completed, 0) < 0 && errno != EINTR) {
+            /* Give up on the ring.  Whatever is still in flight may end
+             * up sent twice, since the blobs stay queued for a resend. */
+            int saved_errno = errno;
+            WARN_ERRNO("io_uring_enter failed, not using io_uring");
+            self->uring_ready = 0;
+            return saved_errno;
+        }
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&self->ring))) {
+            if (cqe->user_data < n)
+                results[cqe->user_data] = cqe->res;
+            uring_cqe_seen(&self->ring);
+            completed++;
+        }
+    }
+
+    queue_t failed;
+    int first_errno = 0;
+    memset(&failed, 0, sizeof(failed));
+
+    for (uint32_t i = 0; i < n; i++) {
+        blob_t *b = queue_shift_nolock(private_queue);
+        if (results[i] == (int) BLOB_BUF_SIZE(b)) {
+            RELAY_ATOMIC_INCREMENT(self->counters.sent_count, 1);
+            *wrote += results[i];
+            worker_queue_dequeued(self, 1, BLOB_BUF_SIZE(b));
+            blob_destroy(b);
+            continue;
+        }
+        if (results[i] < 0) {
+            errno = -results[i];
+            WARN_ERRNO("sendmsg() tried sending %d bytes to %s but sent none", BLOB_BUF_SIZE(b), sck->to_string);
+            RELAY_ATOMIC_INCREMENT(self->counters.error_count, 1);
+        } else {
+            WARN("sendmsg() tried sending %d bytes to %s but sent only %d", BLOB_BUF_SIZE(b), sck->to_string,
+                 results[i]);
+            RELAY_ATOMIC_INCREMENT(self->counters.partial_count, 1);
+            errno = EMSGSIZE;
+        }
+        if (!first_errno)
+            first_errno = errno;
+        queue_append_nolock(&failed, b);
+    }
+
+    /* Put the failed ones back at the head, in their original order. */
+    if (failed.count) {
+        queue_append_tail_nolock(&failed, private_queue);
+        queue_hijack_nolock(&failed, private_queue);
+    }
+
+    return first_errno;
+}
+#endif                          /* #ifdef HAVE_IO_URING */
+
+/* Send the blobs at the head of the queue, up to tcp_send_batch of them,
+ * framed as on the wire, gathered into a single sendmsg().  A sendmsg()
+ * may send only part of it, so keep sending the rest, even if it starts
+ * in the middle of a blob.  The sent blobs are destroyed, a blob sent
+ * only partly is left at the head of the queue.
+ * Returns the errno of the failure, or zero if all of the batch was sent. */
+static int tcp_send_batch(socket_worker_t * self, relay_socket_t * sck, queue_t * private_queue, ssize_t * wrote)
+{
+    const config_t *config = self->base.config;
+    struct iovec iovs[IOV_MAX];
+    struct msghdr msg;
+    queue_cursor_t cursor;
+    uint32_t n = 0;
+
+    for (blob_t * b = queue_cursor_start(&cursor, private_queue); b && n < config->tcp_send_batch && n < IOV_MAX;
+         b = queue_cursor_next(&cursor)) {
+        iovs[n].iov_base = BLOB_DATA_MBR_addr(b);
+        iovs[n].iov_len = BLOB_DATA_MBR_SIZE(b);
+        n++;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iovs;
+    msg.msg_iovlen = n;
+
+    while (msg.msg_iovlen > 0) {
+        if (RELAY_ATOMIC_READ(self->base.stopping))
+            return ECANCELED;
+
+        ssize_t sent = sendmsg(sck->socket, &msg, MSG_NOSIGNAL);
+        RELAY_ATOMIC_INCREMENT(self->counters.send_call_count, 1);
+
+        if (sent == -1) {
+            int send_errno = errno;
+            WARN_ERRNO("sendmsg() tried sending %zu blobs to %s but sent none", (size_t) msg.msg_iovlen,
+                       sck->to_string);
+            RELAY_ATOMIC_INCREMENT(self->counters.error_count, 1);
+            if (send_errno == EINTR) {
+                /* sendmsg() got interrupted by a signal.  Wait a while and retry. */
+                WARN("Interrupted, resuming");
+                worker_wait_millisec(config->sleep_after_disaster_millisec);
+                continue;
+            }
+            blob_t *b = queue_peek(private_queue);
+            if (msg.msg_iov->iov_base != BLOB_DATA_MBR_addr(b)) {
+                WARN("sendmsg() tried sending %zu bytes to %s but sent only %zu", (size_t) BLOB_DATA_MBR_SIZE(b),
+                     sck->to_string, (size_t) BLOB_DATA_MBR_SIZE(b) - msg.msg_iov->iov_len);
+                RELAY_ATOMIC_INCREMENT(self->counters.partial_count, 1);
+            }
+            errno = send_errno;
+            return send_errno;
+        }
+
+        *wrote += sent;
+
+        /* done with the blobs sent whole, and resume from the middle of
+         * the one sent partly */
+        while (msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+            blob_t *b = queue_shift_nolock(private_queue);
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+            RELAY_ATOMIC_INCREMENT(self->counters.sent_count, 1);
+            worker_queue_dequeued(self, 1, BLOB_BUF_SIZE(b));
+            blob_destroy(b);
+        }
+        if (sent > 0) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
 static int process_queue(socket_worker_t * self, relay_socket_t * sck, queue_t * private_queue, queue_t * spill_queue,
                          ssize_t * wrote)
 {
@@ -187,8 +480,6 @@ static int process_queue(socket_worker_t * self, relay_socket_t * sck, queue_t *
 
     get_time(&send_start_time);
 
-    cork(sck, 1);
-
     while (private_queue->head != NULL) {
         get_time(&now);
 
@@ -214,22 +505,47 @@ static int process_queue(socket_worker_t * self, relay_socket_t * sck, queue_t *
         if (in_grace_period == 0) {
             spilled += spill_by_age(self, config->spill_enabled, private_queue, spill_queue, spill_microsec, &now);
         }
+        shed_by_age(self, private_queue, spill_queue, &now);
+        trim_queue(self, private_queue, spill_queue);
 
-        cur_blob = private_queue->head;
+        cur_blob = queue_peek(private_queue);
         if (!cur_blob)
             break;
 
-        void *blob_data;
-        ssize_t blob_size;
+#ifdef HAVE_IO_URING
+        if (self->uring_ready && sck->type == SOCK_DGRAM) {
+            int send_errno = uring_send_batch(self, sck, private_queue, wrote);
+            if (send_errno) {
+                if (send_errno == EAGAIN || send_errno == EWOULDBLOCK) {
+                    /* Traffic jam.  Wait a while, but still get out. */
+                    WARN("Traffic jam");
+                    worker_wait_millisec(config->sleep_after_disaster_millisec);
+                }
+                failed = 1;
+                break;
+            }
+            continue;
+        }
+#endif
 
-        if (sck->type == SOCK_DGRAM) {
-            blob_size = BLOB_BUF_SIZE(cur_blob);
-            blob_data = BLOB_BUF_addr(cur_blob);
-        } else {                /* sck->type == SOCK_STREAM */
-            blob_size = BLOB_DATA_MBR_SIZE(cur_blob);
-            blob_data = BLOB_DATA_MBR_addr(cur_blob);
+        if (sck->type == SOCK_STREAM) {
+            int send_errno = tcp_send_batch(self, sck, private_queue, wrote);
+            if (send_errno) {
+                if (send_errno == EAGAIN || send_errno == EWOULDBLOCK) {
+                    /* Traffic jam.  Wait a while, but still get out. */
+                    WARN("Traffic jam");
+                    worker_wait_millisec(config->sleep_after_disaster_millisec);
+                }
+                failed = 1;
+                break;
+            }
+            continue;
         }
 
+        /* Datagrams and seqpackets keep the message boundaries. */
+        ssize_t blob_size = BLOB_BUF_SIZE(cur_blob);
+        void *blob_data = BLOB_BUF_addr(cur_blob);
+
         ssize_t blob_left = blob_size;
         ssize_t blob_sent = 0;
         int sendto_errno = 0;
@@ -246,10 +562,11 @@ static int process_queue(socket_worker_t * self, relay_socket_t * sck, queue_t *
             sendto_errno = 0;
             if (sck->type == SOCK_DGRAM) {
                 sent = sendto(sck->socket, data, blob_left, MSG_NOSIGNAL, dest_addr, addr_len);
-            } else {            /* sck->type == SOCK_STREAM */
+            } else {            /* connected: SOCK_SEQPACKET */
                 sent = sendto(sck->socket, data, blob_left, MSG_NOSIGNAL, NULL, 0);
             }
             sendto_errno = errno;
+            RELAY_ATOMIC_INCREMENT(self->counters.send_call_count, 1);
 
             if (0) {            /* For debugging. */
                 peek_send(sck, data, blob_left, sent);
@@ -295,12 +612,11 @@ static int process_queue(socket_worker_t * self, relay_socket_t * sck, queue_t *
             break;
         } else {
             queue_shift_nolock(private_queue);
+            worker_queue_dequeued(self, 1, BLOB_BUF_SIZE(cur_blob));
             blob_destroy(cur_blob);
         }
     }
 
-    cork(sck, 0);
-
     get_time(&send_end_time);
 
     if (spilled) {
@@ -323,7 +639,6 @@ void *socket_worker_thread(void *arg)
 {
     socket_worker_t *self = (socket_worker_t *) arg;
 
-    queue_t *main_queue = &self->queue;
     relay_socket_t *sck = NULL;
 
     queue_t private_queue;
@@ -336,6 +651,18 @@ void *socket_worker_thread(void *arg)
 
     int join_err;
 
+#ifdef HAVE_IO_URING
+    int uring_opened = config->io_uring;
+    if (uring_opened) {
+        self->uring_ready = uring_init(&self->ring, 2 * URING_SEND_BATCH);
+        if (!self->uring_ready)
+            WARN_ERRNO("io_uring setup failed, not using io_uring");
+    }
+#else
+    if (config->io_uring)
+        WARN("Built without io_uring, not using io_uring");
+#endif
+
 #define RATE_UPDATE_PERIOD 15
     time_t last_rate_update = 0;
 
@@ -343,13 +670,51 @@ void *socket_worker_thread(void *arg)
         time_t now = time(NULL);
 
         if (!sck) {
+            int nap = config->sleep_after_disaster_millisec;
+            struct timeval down_since;
+            get_time(&down_since);
             SAY("Opening forwarding socket");
-            sck = open_output_socket_eventually(&self->base);
-            if (sck == NULL || !(sck->type == SOCK_DGRAM || sck->type == SOCK_STREAM)) {
+            while (!RELAY_ATOMIC_READ(self->base.stopping) && !(sck = open_output_socket_once(&self->base, &nap))) {
+                struct timeval down_now;
+                get_time(&down_now);
+                /* down for longer than the grace period, have the enqueuers
+                 * send our copies straight to the disk writer */
+                if (!self->diverted
+                    && elapsed_usec(&down_since, &down_now) >= 1000 * (uint64_t) config->spill_grace_millisec) {
+                    self->diverted = 1;
+                    SAY("Destination %s down for over %u millisec, diverting to disk", self->base.arg,
+                        config->spill_grace_millisec);
+                }
+                if (self->diverted) {
+                    divert_queues(self, &private_queue, &spill_queue);
+                    continue;
+                }
+                /* our blobs pile up while the destination is away */
+                if (memory_budget_shedding(&GLOBAL.budget)) {
+                    struct timeval shed_now;
+                    get_time(&shed_now);
+                    hijack_queues(self, &private_queue);
+                    shed_by_age(self, &private_queue, &spill_queue, &shed_now);
+                }
+                if (worker_queue_full(self, 0, 0)) {
+                    hijack_queues(self, &private_queue);
+                    trim_queue(self, &private_queue, &spill_queue);
+                }
+            }
+            if (RELAY_ATOMIC_READ(self->base.stopping)) {
+                /* e.g. a reload removed us while the destination was down */
+                WARN("Stopping, not opening sockets");
+                break;
+            }
+            if (sck == NULL || !(sck->type == SOCK_DGRAM || sck->type == SOCK_STREAM || sck->type == SOCK_SEQPACKET)) {
                 FATAL_ERRNO("Failed to open forwarding socket");
                 break;
             }
             connected_inc();
+            if (self->diverted) {
+                self->diverted = 0;
+                SAY("Destination %s is back, no longer diverting to disk", self->base.arg);
+            }
         }
 
         long since_rate_update = now - last_rate_update;
@@ -366,14 +731,21 @@ void *socket_worker_thread(void *arg)
              * and then reset the queue state to empty. So the formerly
              * shared queue is now private. We only do this if necessary.
              */
-            if (!queue_hijack(main_queue, &private_queue, &GLOBAL.pool.lock)) {
-                /* nothing to do, so sleep a while and redo the loop */
-                worker_wait_millisec(config->polling_interval_millisec);
+            if (!hijack_queues(self, &private_queue)) {
+                /* nothing to do, so sleep until something is queued for us
+                 * (or appended to the fanout log), and redo the loop */
+                if (self->fanout_reader) {
+                    mpsc_queue_park(&self->queue, config->worker_spin_usec, config->worker_park_millisec,
+                                    &GLOBAL.pool.fanout_log->published, self->fanout_reader->read);
+                } else {
+                    mpsc_queue_park(&self->queue, config->worker_spin_usec, config->worker_park_millisec, NULL, 0);
+                }
                 continue;
             }
         }
 
         RELAY_ATOMIC_INCREMENT(self->counters.received_count, private_queue.count);
+        trim_queue(self, &private_queue, &spill_queue);
 
         /* ok, so we should have something in our queue to process */
         if (private_queue.head == NULL) {
@@ -395,6 +767,8 @@ void *socket_worker_thread(void *arg)
     }
 
     if (control_is(RELAY_STOPPING)) {
+        /* the listeners are stopped by now, take what they last queued */
+        hijack_queues(self, &private_queue);
         SAY("Socket worker stopping, trying forwarding flush");
         stats_count_t old_sent = self->totals.sent_count;
         stats_count_t old_spilled = self->totals.spilled_count;
@@ -412,13 +786,17 @@ void *socket_worker_thread(void *arg)
         } else {
             WARN("No forwarding socket to flush to");
         }
-        SAY("Socket worker spilling any remaining events to disk");
-        stats_count_t spilled = spill_all(self, &private_queue, &spill_queue);
-        SAY("Socket worker spilled %llu events to disk", (unsigned long long) spilled);
-    } else {
-        accumulate_and_clear_stats(&self->counters, &self->recents, &self->totals);
     }
 
+    /* Also when a reload removed us: what is left holds its share of the
+     * memory budget and our fanout log nodes, the disk writer releases it.
+     * We are off the pool's list by now, so nothing more gets queued. */
+    hijack_queues(self, &private_queue);
+    SAY("Socket worker spilling any remaining events to disk");
+    stats_count_t spilled = spill_all(self, &private_queue, &spill_queue);
+    SAY("Socket worker spilled %llu events to disk", (unsigned long long) spilled);
+    accumulate_and_clear_stats(&self->counters, &self->recents, &self->totals);
+
     SAY("worker[%s] in its lifetime received %lu sent %lu spilled %lu dropped %lu",
         (sck ? sck->to_string : self->base.arg),
         (unsigned long) RELAY_ATOMIC_READ(self->totals.received_count),
@@ -431,8 +809,15 @@ void *socket_worker_thread(void *arg)
         connected_dec();
     }
 
+#ifdef HAVE_IO_URING
+    if (uring_opened)
+        uring_close(&self->ring);
+    self->uring_ready = 0;
+#endif
+
     /* we are done so shut down our "pet" disk worker, and then exit with a message */
     RELAY_ATOMIC_OR(self->disk_writer->base.stopping, WORKER_STOPPING);
+    mpsc_queue_wake(&self->disk_writer->queue);
 
     join_err = pthread_join(self->disk_writer->base.tid, NULL);
 
@@ -445,6 +830,91 @@ void *socket_worker_thread(void *arg)
 }
 
 
+/* one name=value of the queue limits following a destination address */
+static int parse_queue_limit(char *opt, worker_queue_limits_t * limits)
+{
+    char *val = strchr(opt, '=');
+    char *endp;
+    unsigned long num;
+    int policy;
+
+    if (val == NULL)
+        return 0;
+    *val++ = '\0';
+
+    if (STREQ(opt, "queue_policy")) {
+        policy = memory_budget_policy_parse(val);
+        if (policy < 0 || policy == MEMORY_BUDGET_PAUSE)
+            return 0;
+        limits->policy = policy;
+        return 1;
+    }
+
+    num = strtoul(val, &endp, 10);
+    if (endp == val || *endp || num > UINT32_MAX)
+        return 0;
+    if (STREQ(opt, "queue_max_items"))
+        limits->max_items = num;
+    else if (STREQ(opt, "queue_max_bytes"))
+        limits->max_bytes = num;
+    else
+        return 0;
+    return 1;
+}
+
+/* A destination address may be followed, after whitespace, by queue limits
+ * of its own, for example
+ *
+ *   tcp@host:2003 queue_max_items=100000 queue_policy=drop_newest
+ *
+ * with queue_max_items, queue_max_bytes and queue_policy standing in for
+ * worker_queue_max_items, worker_queue_max_bytes and worker_queue_policy.
+ * Sets the length of the address and the limits, returns zero (having
+ * complained) if they do not parse. */
+int socket_worker_parse_arg(const char *arg, const config_t * config, size_t * address_len,
+                            worker_queue_limits_t * limits)
+{
+    const char *p = arg + strcspn(arg, " \t");
+    int policy = memory_budget_policy_parse(config->worker_queue_policy);
+
+    *address_len = p - arg;
+    limits->max_items = config->worker_queue_max_items;
+    limits->max_bytes = config->worker_queue_max_bytes;
+    /* the config check should not have let a bad one through */
+    limits->policy = policy < 0 ? MEMORY_BUDGET_SPILL : policy;
+
+    while (*(p += strspn(p, " \t"))) {
+        size_t len = strcspn(p, " \t");
+        char opt[64];
+        int ok = len < sizeof(opt);
+
+        if (ok) {
+            memcpy(opt, p, len);
+            opt[len] = '\0';
+            ok = parse_queue_limit(opt, limits);
+        }
+        if (!ok) {
+            WARN("Bad queue limit '%.*s' for %.*s", (int) len, p, (int) *address_len, arg);
+            return 0;
+        }
+        p += len;
+    }
+
+    return 1;
+}
+
+/* at create, and for the workers kept at reload */
+void socket_worker_set_queue_limits(socket_worker_t * worker, const worker_queue_limits_t * limits)
+{
+    worker->queue_max_items = limits->max_items;
+    worker->queue_max_bytes = limits->max_bytes;
+    worker->queue_policy = limits->policy;
+    if (limits->max_items || limits->max_bytes) {
+        SAY("Queue of %s limited to %u items %u bytes, policy %s", worker->base.arg, limits->max_items,
+            limits->max_bytes, memory_budget_policy_name(limits->policy));
+    }
+}
+
 /* initialize a worker safely */
 socket_worker_t *socket_worker_create(const char *arg, const config_t * config)
 {
@@ -456,12 +926,24 @@ socket_worker_t *socket_worker_create(const char *arg, const config_t * config)
 
     int create_err;
 
+    size_t address_len;
+    worker_queue_limits_t limits;
+    if (!socket_worker_parse_arg(arg, config, &address_len, &limits)) {
+        FATAL("Failed to parse worker %s", arg);
+        return NULL;
+    }
+
     worker->base.config = config;
-    worker->base.arg = strdup(arg);
+    worker->base.arg = calloc_or_fatal(address_len + 1);
+    memcpy(worker->base.arg, arg, address_len);
+    socket_worker_set_queue_limits(worker, &limits);
 
     worker->exists = 1;
 
-    if (!socketize(arg, &worker->base.output_socket, IPPROTO_TCP, RELAY_CONN_IS_OUTBOUND, "worker")) {
+    if (GLOBAL.pool.fanout_log)
+        worker->fanout_reader = fanout_log_reader_add(GLOBAL.pool.fanout_log);
+
+    if (!socketize(worker->base.arg, &worker->base.output_socket, IPPROTO_TCP, RELAY_CONN_IS_OUTBOUND, "worker")) {
         FATAL("Failed to socketize worker");
         return NULL;
     }
@@ -481,8 +963,6 @@ socket_worker_t *socket_worker_create(const char *arg, const config_t * config)
     rates_init(&worker->rates[1], DECAY_5MIN);
     rates_init(&worker->rates[2], DECAY_15MIN);
 
-    LOCK_INIT(&worker->lock);
-
     /* setup spill_path */
     int wrote = snprintf(disk_writer->spill_path, PATH_MAX, "%s/event_relay.%s", config->spill_root,
                          worker->base.output_socket.arg_clean);
@@ -512,6 +992,7 @@ socket_worker_t *socket_worker_create(const char *arg, const config_t * config)
 
         /* we died, so shut down our "pet" disk worker, and then exit with a message */
         RELAY_ATOMIC_OR(disk_writer->base.stopping, WORKER_STOPPING);
+        mpsc_queue_wake(&disk_writer->queue);
 
         /* have to handle failure of the shutdown too */
         join_err = pthread_join(disk_writer->base.tid, NULL);
@@ -545,9 +1026,14 @@ void socket_worker_destroy(socket_worker_t * worker)
     if (was_stopping & WORKER_STOPPING)
         return;
 
+    mpsc_queue_wake(&worker->queue);
     pthread_join(worker->base.tid, NULL);
 
-    LOCK_DESTROY(&worker->lock);
+    /* The thread spilled everything it held and its disk writer has written
+     * or dropped that before exiting, so all our fanout log nodes are
+     * released.  The slots we never read are reclaimed as we leave. */
+    if (worker->fanout_reader)
+        fanout_log_reader_remove(GLOBAL.pool.fanout_log, worker->fanout_reader);
 
     free(worker->base.arg);
     free(worker);
@@ -3,19 +3,52 @@
 
 #include "config.h"
 #include "disk_writer.h"
+#include "fanout_log.h"
 #include "relay.h"
 #include "socket_util.h"
 #include "stats.h"
+#include "uring.h"
 #include "worker_base.h"
 
 #define RATE_COUNT 3
 
+/* The most datagrams submitted to the io_uring at a time. */
+#define URING_SEND_BATCH 32
+
+/* The queue limits of a destination: worker_queue_max_items,
+ * worker_queue_max_bytes and worker_queue_policy (parsed, a
+ * memory_budget_policy_t), unless its address is followed by limits of
+ * its own, see socket_worker_parse_arg(). */
+struct worker_queue_limits {
+    uint32_t max_items;
+    uint32_t max_bytes;
+    int32_t policy;
+};
+typedef struct worker_queue_limits worker_queue_limits_t;
+
 struct socket_worker {
     struct worker_base base;
 
-    queue_t queue;
+    mpsc_queue_t queue;
+
+    /* The blobs queued for us, shared or private, and not yet sent,
+     * spilled or dropped, and their payload bytes.  The enqueuers add,
+     * we subtract, see worker_queue_full(). */
+    volatile int64_t queued_count;
+    volatile int64_t queued_bytes;
 
-    LOCK_T lock;
+    /* Set while the destination has been down for longer than
+     * spill_grace_millisec: the enqueuers hand our copies straight to
+     * the disk writer instead of queueing them for us. */
+    volatile uint32_t diverted;
+
+    /* our worker_queue_limits_t, set at create and reload */
+    volatile uint32_t queue_max_items;
+    volatile uint32_t queue_max_bytes;
+    volatile int32_t queue_policy;
+
+    /* with fanout_log_slots, the cursor in the fanout log */
+    fanout_reader_t *fanout_reader;
 
     stats_basic_counters_t counters;
     stats_basic_counters_t recents;
@@ -27,6 +60,16 @@ struct socket_worker {
 
     disk_writer_t *disk_writer;
 
+#ifdef HAVE_IO_URING
+    /* If uring_ready, the udp sends go through the ring.  The messages
+     * being sent live here, not on the stack, so that they stay valid
+     * even if we have to give up waiting for the sends to complete. */
+    uring_t ring;
+    int uring_ready;
+    struct msghdr uring_msgs[URING_SEND_BATCH];
+    struct iovec uring_iovs[URING_SEND_BATCH];
+#endif
+
      TAILQ_ENTRY(socket_worker) entries;
 };
 typedef struct socket_worker socket_worker_t;
@@ -34,6 +77,9 @@ typedef struct socket_worker socket_worker_t;
 socket_worker_t *socket_worker_create(const char *arg, const config_t * config);
 void socket_worker_destroy(socket_worker_t * worker);
 void *socket_worker_thread(void *arg);
+int socket_worker_parse_arg(const char *arg, const config_t * config, size_t * address_len,
+                            worker_queue_limits_t * limits);
+void socket_worker_set_queue_limits(socket_worker_t * worker, const worker_queue_limits_t * limits);
 
 /* worker sleeps while it waits for work
  * XXX this should be configurable */
@@ -7,16 +7,49 @@
 #include "string_util.h"
 
 /* update the process status line with the status of the workers */
-void update_process_status(fixed_buffer_t * buf, config_t * config, stats_count_t received, stats_count_t tcp)
+void update_process_status(fixed_buffer_t * buf, config_t * config)
 {
-    LOCK(&GLOBAL.pool.lock);
+    stats_basic_counters_t received;
+    listener_stats_sum(&received);
+    blob_stats_t blobs;
+    blob_stats_sum(&blobs);
+
+    RDLOCK(&GLOBAL.pool.lock);
     fixed_buffer_reset(buf);
     do {
         for (int i = 0; i < config->argc; i++) {
             if (!fixed_buffer_vcatf(buf, "%s ", config->argv[i]))
                 break;
         }
-        if (fixed_buffer_vcatf(buf, ": received %lu tcp %lu", (unsigned long) received, (unsigned long) tcp)) {
+        if (!fixed_buffer_vcatf(buf, ": received %lu tcp %lu per_recv %.1f", (unsigned long) received.received_count,
+                                (unsigned long) received.tcp_connections,
+                                received.recv_call_count ? (double) received.received_count /
+                                received.recv_call_count : 0.0))
+            break;
+        {
+            uint32_t n_listeners = RELAY_ATOMIC_READ(GLOBAL.n_listeners);
+            if (n_listeners > 1) {
+                if (!fixed_buffer_vcatf(buf, " listeners"))
+                    break;
+                for (uint32_t i = 0; i < n_listeners; i++) {
+                    stats_basic_counters_t *counters = &GLOBAL.listeners[i].counters;
+                    if (!fixed_buffer_vcatf(buf, "%c%lu", i ? '/' : ' ',
+                                            (unsigned long) RELAY_ATOMIC_READ(counters->received_count)))
+                        break;
+                }
+                if (GLOBAL.listener && GLOBAL.listener->type != SOCK_DGRAM) {
+                    if (!fixed_buffer_vcatf(buf, " tcp"))
+                        break;
+                    for (uint32_t i = 0; i < n_listeners; i++) {
+                        stats_basic_counters_t *counters = &GLOBAL.listeners[i].counters;
+                        if (!fixed_buffer_vcatf(buf, "%c%lu", i ? '/' : ' ',
+                                                (unsigned long) RELAY_ATOMIC_READ(counters->tcp_connections)))
+                            break;
+                    }
+                }
+            }
+        }
+        {
             socket_worker_t *w;
             int worker_id = 0;
             TAILQ_FOREACH(w, &GLOBAL.pool.workers, entries) {
@@ -46,6 +79,12 @@ void update_process_status(fixed_buffer_t * buf, config_t * config, stats_count_
                                         (int) w->rates[0].sent.rate,
                                         (int) w->rates[1].sent.rate, (int) w->rates[2].sent.rate))
                     break;
+                {
+                    stats_count_t sent = RELAY_ATOMIC_READ(w->totals.sent_count);
+                    stats_count_t send_calls = RELAY_ATOMIC_READ(w->totals.send_call_count);
+                    if (!fixed_buffer_vcatf(buf, "per_send %.1f ", send_calls ? (double) sent / send_calls : 0.0))
+                        break;
+                }
 
                 if (!fixed_buffer_vcatf(buf,
                                         "spilled %lu/%lu ",
@@ -76,25 +115,32 @@ void update_process_status(fixed_buffer_t * buf, config_t * config, stats_count_
                                         (unsigned long) RELAY_ATOMIC_READ(w->recents.disk_error_count),
                                         (unsigned long) RELAY_ATOMIC_READ(w->totals.disk_error_count)))
                     break;
+
+                if (!fixed_buffer_vcatf(buf,
+                                        " queued %ld bytes %ld",
+                                        (long) RELAY_ATOMIC_READ(w->queued_count),
+                                        (long) RELAY_ATOMIC_READ(w->queued_bytes)))
+                    break;
+                if (w->diverted && !fixed_buffer_vcatf(buf, " diverted"))
+                    break;
             }
         }
         if (!fixed_buffer_vcatf
             (buf, " : blobs active %ld bytes %ld refcnt_bytes %ld total %ld bytes %ld refcnt_bytes %ld",
-             RELAY_ATOMIC_READ(GLOBAL.blob_active_count), RELAY_ATOMIC_READ(GLOBAL.blob_active_bytes),
-             RELAY_ATOMIC_READ(GLOBAL.blob_active_refcnt_bytes), RELAY_ATOMIC_READ(GLOBAL.blob_total_count),
-             RELAY_ATOMIC_READ(GLOBAL.blob_total_bytes), RELAY_ATOMIC_READ(GLOBAL.blob_total_refcnt_bytes))) {
+             blobs.active_count, blobs.active_bytes, blobs.active_refcnt_bytes, blobs.total_count, blobs.total_bytes,
+             blobs.total_refcnt_bytes)) {
             break;
         }
         {
-            int64_t buckets = RELAY_ATOMIC_READ(GLOBAL.blob_total_ored_buckets);
+            int64_t buckets = blobs.total_ored_buckets;
             if (buckets) {
                 if (!fixed_buffer_vcatf(buf, " buckets:", buckets)) {
                     break;
                 }
                 for (int i = 0;
-                     buckets && i < (int) sizeof(GLOBAL.blob_total_sizes) / (int) sizeof(GLOBAL.blob_total_sizes[0]);
+                     buckets && i < (int) sizeof(blobs.total_sizes) / (int) sizeof(blobs.total_sizes[0]);
                      i++, buckets >>= 1) {
-                    int64_t count = RELAY_ATOMIC_READ(GLOBAL.blob_total_sizes[i]);
+                    int64_t count = blobs.total_sizes[i];
                     if (count > 0 && !fixed_buffer_vcatf(buf, " %d:%ld", i, count)) {
                         break;
                     }
@@ -102,38 +148,155 @@ void update_process_status(fixed_buffer_t * buf, config_t * config, stats_count_
             }
         }
     } while (0);
-    UNLOCK(&GLOBAL.pool.lock);
+    RWUNLOCK(&GLOBAL.pool.lock);
     fixed_buffer_zero_terminate(buf);
     setproctitle(buf->data);
 }
 
-/* add an item to all workers queues
- * (not sure if this really belongs in worker.c)
+/* would count more blobs, of bytes payload bytes, take a worker over its
+ * queue limits */
+int worker_queue_full(const socket_worker_t * w, uint32_t count, uint64_t bytes)
+{
+    uint32_t max_items = w->queue_max_items;
+    uint32_t max_bytes = w->queue_max_bytes;
+
+    return (max_items && w->queued_count + count > max_items)
+        || (max_bytes && w->queued_bytes + (int64_t) bytes > max_bytes);
+}
+
+/* With the spill and drop_newest worker_queue_policy a full worker has
+ * the copied batches spilled or dropped for it right here, before they
+ * get to its queue, with drop_oldest it makes room itself.  (A full
+ * worker reading the fanout log refuses the newest itself, see
+ * trim_queue().) */
+static int worker_queue_refuses(const socket_worker_t * w, uint32_t count, uint64_t bytes)
+{
+    return w->queue_policy != MEMORY_BUDGET_DROP_OLDEST && worker_queue_full(w, count, bytes);
+}
+
+/* the blobs copied while the fanout log was full have to go out before
+ * anything appended to the log after them, so keep copying until every
+ * worker has taken its copies.  Full and diverted workers stay on the
+ * log, they spill or drop what they read from it themselves. */
+static int fanout_log_blocked(void)
+{
+    socket_worker_t *w;
+    TAILQ_FOREACH(w, &GLOBAL.pool.workers, entries) {
+        if (w->queue.top)
+            return 1;
+    }
+    return 0;
+}
+
+/* the batch (or a copy of it) goes to the worker's disk writer instead
+ * of its queue (which drops it if spilling is disabled) */
+static void worker_queue_spill(socket_worker_t * w, queue_t * q)
+{
+    if (GLOBAL.config->spill_enabled) {
+        RELAY_ATOMIC_INCREMENT(w->counters.spilled_count, q->count);
+    } else {
+        RELAY_ATOMIC_INCREMENT(w->counters.dropped_count, q->count);
+    }
+    mpsc_queue_append_tail(&w->disk_writer->queue, q);
+}
+
+/* the batch (or a copy of it) will not be queued for a full worker */
+static void worker_queue_refuse(socket_worker_t * w, queue_t * q)
+{
+    queue_cursor_t cursor;
+    blob_t *b;
+
+    if (w->queue_policy == MEMORY_BUDGET_SPILL) {
+        worker_queue_spill(w, q);
+        return;
+    }
+
+    RELAY_ATOMIC_INCREMENT(w->counters.dropped_count, q->count);
+    for (b = queue_cursor_start(&cursor, q); b; b = queue_cursor_next(&cursor))
+        blob_destroy(b);
+    queue_clear_nolock(q);
+}
+
+/* add a batch of items (say one recvmmsg() worth) to all workers queues,
+ * emptying the batch.
+ *
+ * The pool lock is only read locked, to keep the workers from going away,
+ * and each worker gets a copy of the batch (the blob pointers, the blobs
+ * are shared) appended to its lock-free queue in one go.
+ * With fanout_log_slots the batch is appended to the fanout log instead,
+ * once for all the workers, unless the log is full.
+ *
+ * Over the memory budget with the drop_newest policy the batch is dropped,
+ * and a worker over its queue limits may have its copy spilled or
+ * dropped, see worker_queue_refuses().  A worker whose destination is
+ * down, see socket_worker.diverted, has its copy spilled.
  */
-int enqueue_blob_for_transmission(blob_t * b)
+int enqueue_blobs_for_transmission(queue_t * batch)
 {
+    int n_workers;
     int i = 0;
     socket_worker_t *w;
-    blob_t *to_enqueue;
-    LOCK(&GLOBAL.pool.lock);
-    BLOB_REFCNT_set(b, GLOBAL.pool.n_workers);
+    blob_t *b;
+    queue_cursor_t cursor;
+    queue_t copy;
+    uint32_t count = batch->count;
+    uint64_t bytes = 0;
+
+    if (count == 0)
+        return 0;
+
+    if (memory_budget_over(&GLOBAL.budget) && GLOBAL.budget.policy == MEMORY_BUDGET_DROP_NEWEST) {
+        RELAY_ATOMIC_INCREMENT(GLOBAL.budget.dropped_newest_count, count);
+        while ((b = queue_shift_nolock(batch)))
+            blob_destroy(b);
+        return 0;
+    }
+
+    for (b = queue_cursor_start(&cursor, batch); b; b = queue_cursor_next(&cursor))
+        bytes += BLOB_BUF_SIZE(b);
+
+    RDLOCK(&GLOBAL.pool.lock);
+    n_workers = GLOBAL.pool.n_workers;
+    if (n_workers && GLOBAL.pool.fanout_log && !fanout_log_blocked()
+        && fanout_log_append(GLOBAL.pool.fanout_log, batch)) {
+        /* a worker may take them before it sees them counted, so the
+         * counts can go negative for a moment */
+        TAILQ_FOREACH(w, &GLOBAL.pool.workers, entries) {
+            RELAY_ATOMIC_INCREMENT(w->queued_count, count);
+            RELAY_ATOMIC_INCREMENT(w->queued_bytes, bytes);
+            mpsc_queue_wake(&w->queue);
+        }
+        RWUNLOCK(&GLOBAL.pool.lock);
+        return n_workers;
+    }
+    /* the fanout log is full (or off, or blocked), copy */
+    for (b = queue_cursor_start(&cursor, batch); b; b = queue_cursor_next(&cursor))
+        BLOB_REFCNT_set(b, n_workers);
     TAILQ_FOREACH(w, &GLOBAL.pool.workers, entries) {
-        /* check if this item is no the last */
-        if (TAILQ_NEXT(w, entries) == NULL) {
-            /* this is the last item in the chain, just use b. */
-            to_enqueue = b;
+        /* the last worker gets the batch itself */
+        queue_t *q = batch;
+        if (TAILQ_NEXT(w, entries) != NULL) {
+            queue_copy_nolock(batch, &copy);
+            q = &copy;
+        }
+        if (w->diverted) {
+            worker_queue_spill(w, q);
+        } else if (worker_queue_refuses(w, count, bytes)) {
+            worker_queue_refuse(w, q);
         } else {
-            /* not the last, so we need to clone the original object */
-            to_enqueue = blob_clone_no_refcnt_inc(b);
+            RELAY_ATOMIC_INCREMENT(w->queued_count, count);
+            RELAY_ATOMIC_INCREMENT(w->queued_bytes, bytes);
+            mpsc_queue_append_tail(&w->queue, q);
         }
-        queue_append_nolock(&w->queue, to_enqueue);
         i++;
     }
-    UNLOCK(&GLOBAL.pool.lock);
+    RWUNLOCK(&GLOBAL.pool.lock);
+
     if (i == 0) {
         /* TODO dump the packet on disk? */
         WARN("no living workers, not sure what to do");
-        blob_destroy(b);
+        while ((b = queue_shift_nolock(batch)))
+            blob_destroy(b);
     }
     return i;
 }
@@ -144,10 +307,14 @@ void worker_pool_init_static(config_t * config)
 {
     socket_worker_t *new_worker;
     TAILQ_INIT(&GLOBAL.pool.workers);
-    LOCK_INIT(&GLOBAL.pool.lock);
-    LOCK(&GLOBAL.pool.lock);
+    RWLOCK_INIT(&GLOBAL.pool.lock);
+    WRLOCK(&GLOBAL.pool.lock);
     GLOBAL.pool.n_workers = 0;
     GLOBAL.pool.n_connected = 0;
+    if (config->fanout_log_slots) {
+        GLOBAL.pool.fanout_log = fanout_log_create(config->fanout_log_slots);
+        SAY("Using a fanout log of %u slots", config->fanout_log_slots);
+    }
     for (int i = 1; i < config->argc; i++) {
         if (control_is(RELAY_STOPPING))
             break;
@@ -155,7 +322,7 @@ void worker_pool_init_static(config_t * config)
         TAILQ_INSERT_HEAD(&GLOBAL.pool.workers, new_worker, entries);
         GLOBAL.pool.n_workers++;
     }
-    UNLOCK(&GLOBAL.pool.lock);
+    RWUNLOCK(&GLOBAL.pool.lock);
 }
 
 /* re-initialize a pool of workers
@@ -166,19 +333,26 @@ void worker_pool_reload_static(config_t * config)
     socket_worker_t *w;
     socket_worker_t *wtmp;
     int n_workers = 0;
-    LOCK(&GLOBAL.pool.lock);
+    WRLOCK(&GLOBAL.pool.lock);
     /* clear the exists bit of each worker */
     TAILQ_FOREACH(w, &GLOBAL.pool.workers, entries) {
         w->exists = 0;
     }
 
     /* scan through each argument, and see if we need
-     * to add a new worker for it, or if we already have it */
+     * to add a new worker for it, or if we already have it
+     * (the queue limits following the address may have changed) */
     for (int i = 1; i < config->argc; i++) {
+        size_t address_len;
+        worker_queue_limits_t limits;
+        int parsed = socket_worker_parse_arg(config->argv[i], config, &address_len, &limits);
         must_add = 1;
         TAILQ_FOREACH(w, &GLOBAL.pool.workers, entries) {
-            if (!w->exists && STREQ(config->argv[i], w->base.arg)) {
+            if (!w->exists && strlen(w->base.arg) == address_len
+                && strncmp(config->argv[i], w->base.arg, address_len) == 0) {
                 w->exists = 1;
+                if (parsed)
+                    socket_worker_set_queue_limits(w, &limits);
                 must_add = 0;
                 break;
             }
@@ -186,33 +360,41 @@ void worker_pool_reload_static(config_t * config)
         if (must_add) {
             w = socket_worker_create(config->argv[i], config);  /* w will have w->exists == 1 */
             TAILQ_INSERT_TAIL(&GLOBAL.pool.workers, w, entries);
+            RELAY_ATOMIC_INCREMENT(GLOBAL.pool.n_workers, 1);
         }
     }
 
     TAILQ_FOREACH_SAFE(w, &GLOBAL.pool.workers, entries, wtmp) {
         if (w->exists == 0) {
             TAILQ_REMOVE(&GLOBAL.pool.workers, w, entries);
-            UNLOCK(&GLOBAL.pool.lock);
+            /* the enqueuers may get in while we are unlocked,
+             * so the count has to match the list already */
+            RELAY_ATOMIC_DECREMENT(GLOBAL.pool.n_workers, 1);
+            RWUNLOCK(&GLOBAL.pool.lock);
             socket_worker_destroy(w);   /*  might lock */
-            LOCK(&GLOBAL.pool.lock);
+            WRLOCK(&GLOBAL.pool.lock);
         } else {
             n_workers++;
         }
     }
     GLOBAL.pool.n_workers = n_workers;
-    UNLOCK(&GLOBAL.pool.lock);
+    RWUNLOCK(&GLOBAL.pool.lock);
 }
 
 /* worker destory static, destroy all the workers in the pool */
 void worker_pool_destroy_static(void)
 {
     socket_worker_t *w;
-    LOCK(&GLOBAL.pool.lock);
+    WRLOCK(&GLOBAL.pool.lock);
     while ((w = TAILQ_FIRST(&GLOBAL.pool.workers)) != NULL) {
         TAILQ_REMOVE(&GLOBAL.pool.workers, w, entries);
-        UNLOCK(&GLOBAL.pool.lock);
+        RWUNLOCK(&GLOBAL.pool.lock);
         socket_worker_destroy(w);       /*  might lock */
-        LOCK(&GLOBAL.pool.lock);
+        WRLOCK(&GLOBAL.pool.lock);
+    }
+    if (GLOBAL.pool.fanout_log) {
+        fanout_log_destroy(GLOBAL.pool.fanout_log);
+        GLOBAL.pool.fanout_log = NULL;
     }
-    UNLOCK(&GLOBAL.pool.lock);
+    RWUNLOCK(&GLOBAL.pool.lock);
 }
@@ -8,16 +8,21 @@
 struct socket_worker_pool {
     /* macro to define a TAILQ head entry, empty first arg deliberate */
     TAILQ_HEAD(, socket_worker) workers;
-    LOCK_T lock;
-    int n_workers;
-    int n_connected;
+    /* Write locked only to change the workers, the worker queues
+     * themselves need no locking. */
+    RWLOCK_T lock;
+    volatile int n_workers;
+    volatile int n_connected;
+    /* if non-NULL, the workers read the blobs from here */
+    fanout_log_t *fanout_log;
 };
 typedef struct socket_worker_pool socket_worker_pool_t;
 
 void worker_pool_init_static(config_t * config);
 void worker_pool_reload_static(config_t * config);
 void worker_pool_destroy_static(void);
-int enqueue_blob_for_transmission(blob_t * b);
-void update_process_status(fixed_buffer_t * buf, config_t * config, stats_count_t received, stats_count_t tcp);
+int enqueue_blobs_for_transmission(queue_t * batch);
+int worker_queue_full(const socket_worker_t * w, uint32_t count, uint64_t bytes);
+void update_process_status(fixed_buffer_t * buf, config_t * config);
 
 #endif                          /* #ifndef RELAY_SOCKET_WORKER_POOL_H */
@@ -38,6 +38,7 @@ void accumulate_and_clear_stats(stats_basic_counters_t * counters, stats_basic_c
     stats_count_t disk_count = RELAY_ATOMIC_READ(counters->disk_count);
     stats_count_t disk_error_count = RELAY_ATOMIC_READ(counters->disk_error_count);
     stats_count_t send_elapsed_usec = RELAY_ATOMIC_READ(counters->send_elapsed_usec);
+    stats_count_t send_call_count = RELAY_ATOMIC_READ(counters->send_call_count);
 
     RELAY_ATOMIC_INCREMENT(recents->received_count, received_count);
     RELAY_ATOMIC_INCREMENT(recents->sent_count, sent_count);
@@ -48,6 +49,7 @@ void accumulate_and_clear_stats(stats_basic_counters_t * counters, stats_basic_c
     RELAY_ATOMIC_INCREMENT(recents->disk_count, disk_count);
     RELAY_ATOMIC_INCREMENT(recents->disk_error_count, disk_error_count);
     RELAY_ATOMIC_INCREMENT(recents->send_elapsed_usec, send_elapsed_usec);
+    RELAY_ATOMIC_INCREMENT(recents->send_call_count, send_call_count);
 
     if (totals) {
         RELAY_ATOMIC_INCREMENT(totals->received_count, received_count);
@@ -59,6 +61,7 @@ void accumulate_and_clear_stats(stats_basic_counters_t * counters, stats_basic_c
         RELAY_ATOMIC_INCREMENT(totals->disk_count, disk_count);
         RELAY_ATOMIC_INCREMENT(totals->disk_error_count, disk_error_count);
         RELAY_ATOMIC_INCREMENT(totals->send_elapsed_usec, send_elapsed_usec);
+        RELAY_ATOMIC_INCREMENT(totals->send_call_count, send_call_count);
     }
 
     RELAY_ATOMIC_DECREMENT(counters->received_count, received_count);
@@ -70,4 +73,5 @@ void accumulate_and_clear_stats(stats_basic_counters_t * counters, stats_basic_c
     RELAY_ATOMIC_DECREMENT(counters->disk_count, disk_count);
     RELAY_ATOMIC_DECREMENT(counters->disk_error_count, disk_error_count);
     RELAY_ATOMIC_DECREMENT(counters->send_elapsed_usec, send_elapsed_usec);
+    RELAY_ATOMIC_DECREMENT(counters->send_call_count, send_call_count);
 }
@@ -32,7 +32,16 @@ struct stats_basic_counters {
     volatile stats_count_t disk_error_count;    /* number of items we failed to write to disk properly */
 
     volatile stats_count_t send_elapsed_usec;   /* elapsed time in microseconds that we spent sending data */
+    volatile stats_count_t send_call_count;     /* number of send syscalls the worker made */
     volatile stats_count_t tcp_connections;     /* current number of active inbound tcp connections */
+    volatile stats_count_t recv_call_count;     /* number of receive syscalls the listener made */
+    volatile stats_count_t tcp_buffers_in_use;  /* current number of tcp staging buffers held by connections */
+    volatile stats_count_t tcp_buffer_bytes;    /* current bytes of tcp staging buffers held by connections */
+    volatile stats_count_t tcp_buffers_pooled;  /* current number of free tcp staging buffers kept for reuse */
+    volatile stats_count_t kernel_drops;        /* number of datagrams the kernel dropped on closed listener sockets */
+    volatile stats_count_t rxq_drops;   /* the kernel_drops the listener learned of with SO_RXQ_OVFL */
+    volatile stats_count_t rxq_bytes;   /* current bytes queued on the listener sockets */
+    volatile stats_count_t rcvbuf_bytes;        /* the receive buffer sizes of the listener sockets */
 };
 typedef struct stats_basic_counters stats_basic_counters_t;
 
@@ -72,6 +72,30 @@ void reverse_dotwise(char *str)
     }
 }
 
+static int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+ssize_t hex_decode(const char *str, unsigned char *out, size_t size)
+{
+    size_t n = 0;
+    for (const char *p = str; *p; p += 2) {
+        int hi = hex_digit(p[0]);
+        int lo = hi < 0 ? -1 : hex_digit(p[1]);
+        if (lo < 0 || n == size)
+            return -1;
+        out[n++] = (unsigned char) (hi << 4 | lo);
+    }
+    return (ssize_t) n;
+}
+
 fixed_buffer_t *fixed_buffer_create(size_t size)
 {
     fixed_buffer_t *b = (fixed_buffer_t *) malloc(sizeof(fixed_buffer_t) + size);
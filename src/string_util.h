@@ -15,6 +15,10 @@ void trim_space(char *str);
 /* Reverses the string by dot-separated elements. */
 void reverse_dotwise(char *str);
 
+/* Decodes a string of hex digit pairs into at most size bytes.
+ * Returns the number of bytes, or -1 if the string is not valid. */
+ssize_t hex_decode(const char *str, unsigned char *out, size_t size);
+
 #define STREQ(a, b) (strcmp((a),(b))==0)
 #define STRNE(a, b) (strcmp((a),(b))!=0)
 
@@ -1,12 +1,35 @@
 #include "timer.h"
 
+static int timespec_to_timeval(const struct timespec *ts, struct timeval *t)
+{
+    t->tv_sec = ts->tv_sec;
+    t->tv_usec = ts->tv_nsec / 1000;
+    return 0;
+}
+
 int get_time(struct timeval *t)
 {
-    return gettimeofday(t, 0);
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts))
+        return -1;
+    return timespec_to_timeval(&ts, t);
 }
 
 uint64_t elapsed_usec(const struct timeval * start_time, const struct timeval * end_time)
 {
-    return (uint64_t) ((end_time->tv_sec - start_time->tv_sec) * 1000000)
-        + (uint64_t) end_time->tv_usec - (uint64_t) start_time->tv_usec;
+    int64_t usec = (int64_t) (end_time->tv_sec - start_time->tv_sec) * 1000000
+        + (int64_t) end_time->tv_usec - (int64_t) start_time->tv_usec;
+    return usec > 0 ? (uint64_t) usec : 0;
+}
+
+time_t wall_time_sec(const struct timeval * t)
+{
+    struct timeval now;
+    struct timeval wall;
+
+    if (get_time(&now) || gettimeofday(&wall, 0))
+        return time(NULL);
+    /* How long ago it was is what the monotonic clock can tell. */
+    return (time_t) ((wall.tv_sec * (int64_t) 1000000 + wall.tv_usec - (int64_t) elapsed_usec(t, &now)) / 1000000);
 }
@@ -3,8 +3,18 @@
 
 #include <stdint.h>
 #include <sys/time.h>
+#include <time.h>
 
+/* The times are of the monotonic clock, so that stepping the wall clock
+ * (say, by NTP) does not make everything look too old or too new at once.
+ * They are good only for measuring elapsed times. */
 int get_time(struct timeval *t);
+
+/* Zero if the end is before the start: the times may come from
+ * different threads, and be taken in either order. */
 uint64_t elapsed_usec(const struct timeval *start_time, const struct timeval *end_time);
 
+/* The wall clock second of a get_time() time, as of now. */
+time_t wall_time_sec(const struct timeval *t);
+
 #endif                          /* #ifndef RELAY_TIMER_H */
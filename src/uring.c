@@ -0,0 +1,237 @@
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define URING_LOAD_ACQUIRE(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define URING_STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg,
+                              size_t argsz)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Returns 1 if the ring was set up, 0 if not (with errno set). */
+int uring_init(uring_t * ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        return 0;
+
+    /* The timeouts of uring_submit_and_wait() need IORING_ENTER_EXT_ARG. */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return 0;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* The submission queue entries are used in order,
+     * so the indirection array is the identity. */
+    for (unsigned i = 0; i < p.sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    return 1;
+
+  fail:
+    {
+        int saved_errno = errno;
+        if (ring->sq_ring == MAP_FAILED)
+            ring->sq_ring = NULL;
+        uring_close(ring);
+        errno = saved_errno;
+    }
+    return 0;
+}
+
+void uring_close(uring_t * ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t * ring)
+{
+    unsigned head = URING_LOAD_ACQUIRE(ring->sq_head);
+
+    if (ring->sqe_tail - head >= ring->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int uring_submit_and_wait(uring_t * ring, unsigned wait_nr, unsigned timeout_millisec)
+{
+    unsigned to_submit = ring->sqe_tail - *ring->sq_tail;
+    unsigned flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    URING_STORE_RELEASE(ring->sq_tail, ring->sqe_tail);
+
+    if (wait_nr)
+        flags |= IORING_ENTER_GETEVENTS;
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait_nr && timeout_millisec) {
+        ts.tv_sec = timeout_millisec / 1000;
+        ts.tv_nsec = (timeout_millisec % 1000) * 1000000L;
+        arg.ts = (uint64_t) (uintptr_t) & ts;
+    }
+
+    return sys_io_uring_enter(ring->fd, to_submit, wait_nr, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t * ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == URING_LOAD_ACQUIRE(ring->cq_tail))
+        return NULL;
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t * ring)
+{
+    URING_STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+/* The entries must be a power of two.
+ * Returns 1 if the buffer ring was registered, 0 if not (with errno set). */
+int uring_buf_ring_init(uring_t * ring, uring_buf_ring_t * buf_ring, unsigned entries, uint16_t bgid)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(buf_ring, 0, sizeof(*buf_ring));
+    buf_ring->size = entries * sizeof(struct io_uring_buf);
+    buf_ring->br = mmap(NULL, buf_ring->size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (buf_ring->br == MAP_FAILED) {
+        buf_ring->br = NULL;
+        return 0;
+    }
+    buf_ring->entries = entries;
+    buf_ring->bgid = bgid;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) buf_ring->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved_errno = errno;
+        munmap(buf_ring->br, buf_ring->size);
+        buf_ring->br = NULL;
+        errno = saved_errno;
+        return 0;
+    }
+
+    return 1;
+}
+
+void uring_buf_ring_close(uring_t * ring, uring_buf_ring_t * buf_ring)
+{
+    struct io_uring_buf_reg reg;
+
+    if (!buf_ring->br)
+        return;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = buf_ring->bgid;
+    (void) sys_io_uring_register(ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(buf_ring->br, buf_ring->size);
+    buf_ring->br = NULL;
+}
+
+void uring_buf_ring_add(uring_buf_ring_t * buf_ring, void *addr, unsigned len, uint16_t bid)
+{
+    struct io_uring_buf *buf = &buf_ring->br->bufs[buf_ring->tail & (buf_ring->entries - 1)];
+
+    buf->addr = (uint64_t) (uintptr_t) addr;
+    buf->len = len;
+    buf->bid = bid;
+    buf_ring->tail++;
+}
+
+void uring_buf_ring_publish(uring_buf_ring_t * buf_ring)
+{
+    URING_STORE_RELEASE(&buf_ring->br->tail, buf_ring->tail);
+}
+
+#endif                          /* #ifdef HAVE_IO_URING */
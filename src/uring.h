@@ -0,0 +1,87 @@
+#ifndef RELAY_URING_H
+#define RELAY_URING_H
+
+/* A minimal io_uring wrapper on top of the raw system calls, covering
+ * just what the relay uses: one submission and completion queue, and
+ * the rings of provided buffers.
+ *
+ * Built only with HAVE_IO_URING.  Even then the kernel may refuse to
+ * set up a ring (too old, or disabled by sysctl), so the callers must
+ * be prepared to fall back to the plain system calls. */
+
+#ifdef HAVE_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "relay_common.h"
+
+/* <linux/io_uring.h> pulls in <linux/limits.h>, whose PATH_MAX would
+ * change the size of the path buffers of relay_common.h behind our back. */
+#pragma push_macro("PATH_MAX")
+#include <linux/io_uring.h>
+#pragma pop_macro("PATH_MAX")
+
+struct uring {
+    int fd;
+
+    /* The submission queue. */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    /* The tail we have filled up to, not yet published to the kernel. */
+    unsigned sqe_tail;
+    unsigned sq_entries;
+
+    /* The completion queue. */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+typedef struct uring uring_t;
+
+/* A ring of buffers the kernel picks from for the requests
+ * with IOSQE_BUFFER_SELECT in the given buffer group. */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *br;
+    size_t size;
+    unsigned entries;
+    uint16_t tail;
+    uint16_t bgid;
+};
+typedef struct uring_buf_ring uring_buf_ring_t;
+
+int uring_init(uring_t * ring, unsigned entries);
+void uring_close(uring_t * ring);
+
+/* Returns NULL if the submission queue is full. */
+struct io_uring_sqe *uring_get_sqe(uring_t * ring);
+
+/* Submits the queued requests and waits for at least wait_nr completions,
+ * or at most timeout_millisec if that is non-zero.  Returns the number
+ * of requests submitted, or -1 with errno set (ETIME if timed out). */
+int uring_submit_and_wait(uring_t * ring, unsigned wait_nr, unsigned timeout_millisec);
+
+/* Returns the next completion, or NULL if there is none. */
+struct io_uring_cqe *uring_peek_cqe(uring_t * ring);
+void uring_cqe_seen(uring_t * ring);
+
+int uring_buf_ring_init(uring_t * ring, uring_buf_ring_t * buf_ring, unsigned entries, uint16_t bgid);
+void uring_buf_ring_close(uring_t * ring, uring_buf_ring_t * buf_ring);
+
+/* Hands a buffer to the kernel, visible to it once published. */
+void uring_buf_ring_add(uring_buf_ring_t * buf_ring, void *addr, unsigned len, uint16_t bid);
+void uring_buf_ring_publish(uring_buf_ring_t * buf_ring);
+
+#endif                          /* #ifdef HAVE_IO_URING */
+
+#endif                          /* #ifndef RELAY_URING_H */
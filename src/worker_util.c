@@ -1,28 +1,36 @@
 #include "log.h"
 #include "worker_util.h"
 
-relay_socket_t *open_output_socket_eventually(struct worker_base *base)
+/* One attempt at opening the output socket.  If it fails, wait *nap
+ * millisec, and double the *nap (up to a limit) for the next attempt,
+ * which should start with config->sleep_after_disaster_millisec. */
+relay_socket_t *open_output_socket_once(struct worker_base *base, int *nap)
 {
     const config_t *config = base->config;
-    relay_socket_t *sck = NULL;
-    int nap = config->sleep_after_disaster_millisec;
     int max = config->max_socket_open_wait_millisec;
 
-    while (!RELAY_ATOMIC_READ(base->stopping) && !sck) {
-        if (open_socket(&base->output_socket, DO_CONNECT, config->server_socket_sndbuf_bytes, 0)) {
-            sck = &base->output_socket;
-        } else {
-            /* no socket - wait a while, double the wait (up to a limit), and then redo the loop */
-            SAY("waiting %d millisec to retry socket %s", nap, base->output_socket.to_string);
-            worker_wait_millisec(nap);
-            if (nap < max) {
-                nap = 2 * nap + (time(NULL) & 31);      /* "Random" fuzz of up to 0.031s. */
-            }
-            if (nap > max) {
-                nap = max;
-            }
-        }
+    if (open_socket(&base->output_socket, DO_CONNECT, config->server_socket_sndbuf_bytes, 0))
+        return &base->output_socket;
+
+    /* no socket - wait a while, double the wait (up to a limit) */
+    SAY("waiting %d millisec to retry socket %s", *nap, base->output_socket.to_string);
+    worker_wait_millisec(*nap);
+    if (*nap < max) {
+        *nap = 2 * *nap + (time(NULL) & 31);    /* "Random" fuzz of up to 0.031s. */
     }
+    if (*nap > max) {
+        *nap = max;
+    }
+    return NULL;
+}
+
+relay_socket_t *open_output_socket_eventually(struct worker_base *base)
+{
+    relay_socket_t *sck = NULL;
+    int nap = base->config->sleep_after_disaster_millisec;
+
+    while (!RELAY_ATOMIC_READ(base->stopping) && !sck)
+        sck = open_output_socket_once(base, &nap);
 
     if (RELAY_ATOMIC_READ(base->stopping)) {
         WARN("Stopping, not opening sockets");
@@ -0,0 +1,195 @@
+/* Benchmark of the shared memory ingest ring against loopback udp.
+ *
+ * A producer thread sends the frames, and a consumer thread drains them
+ * like the relay listener would: from the ring as in shm_server() of
+ * relay.c, or with recv() from a udp socket.  The producer retries when
+ * the ring is full, while udp simply loses what does not fit in the
+ * socket buffer, so the delivered count is reported for both.
+ *
+ * Build with "make bench", run as bin/bench_shm_ingest [frames]. */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/shm_ring.h"
+
+#define RING_BYTES (16 * 1024 * 1024)
+#define MAX_FRAME 0xFFFF
+
+struct bench {
+    uint32_t frame_size;
+    uint64_t frames;
+    volatile int done;
+    uint64_t received;
+    uint64_t sink;
+    shm_ring_t ring;
+    int fd;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *shm_consumer(void *arg)
+{
+    struct bench *b = arg;
+    unsigned char *buf = malloc(MAX_FRAME);
+
+    while (b->received < b->frames) {
+        uint32_t size;
+        int drained = 0;
+        while (shm_ring_next(&b->ring, &size) == 1) {
+            shm_ring_read(&b->ring, buf, size);
+            b->sink += buf[0];
+            b->received++;
+            drained++;
+        }
+        shm_ring_release(&b->ring);
+        if (!drained)
+            shm_ring_wait(&b->ring, 100);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void *udp_consumer(void *arg)
+{
+    struct bench *b = arg;
+    unsigned char *buf = malloc(MAX_FRAME);
+
+    /* The producer is done when the socket has been quiet for the
+     * receive timeout, the datagrams lost by then are lost for good. */
+    for (;;) {
+        ssize_t received = recv(b->fd, buf, MAX_FRAME, 0);
+        if (received < 0) {
+            if (b->done)
+                break;
+            continue;
+        }
+        b->sink += buf[0];
+        b->received++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void bench_shm(uint32_t frame_size, uint64_t frames)
+{
+    struct bench b;
+    char name[64];
+    shm_ring_t producer;
+    pthread_t tid;
+
+    memset(&b, 0, sizeof(b));
+    b.frame_size = frame_size;
+    b.frames = frames;
+    snprintf(name, sizeof(name), "/relay-bench-%d", (int) getpid());
+
+    if (shm_ring_create(&b.ring, name, RING_BYTES) || shm_ring_open(&producer, name)) {
+        perror("shm ring");
+        exit(1);
+    }
+
+    unsigned char *frame = malloc(frame_size);
+    memset(frame, 'x', frame_size);
+    uint64_t full = 0;
+
+    double start = now();
+    pthread_create(&tid, NULL, shm_consumer, &b);
+    for (uint64_t i = 0; i < frames; i++) {
+        while (shm_ring_send(&producer, frame, frame_size)) {
+            if (errno != EAGAIN) {
+                perror("shm_ring_send");
+                exit(1);
+            }
+            full++;
+            sched_yield();
+        }
+    }
+    double sent = now();
+    pthread_join(tid, NULL);
+    double elapsed = now() - start;
+
+    printf("%6u %-4s %10llu sent %10llu received %8.1f ns/send %8.1f ns/frame %10.1f MB/s (%llu full)\n",
+           frame_size, "shm", (unsigned long long) frames, (unsigned long long) b.received,
+           (sent - start) * 1e9 / frames, elapsed * 1e9 / b.received, b.received * frame_size / elapsed / 1e6,
+           (unsigned long long) full);
+
+    free(frame);
+    shm_ring_close(&producer);
+    shm_ring_destroy(&b.ring);
+}
+
+static void bench_udp(uint32_t frame_size, uint64_t frames)
+{
+    struct bench b;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    struct timeval timeout = { 0, 200000 };
+    int rcvbuf = RING_BYTES;
+    pthread_t tid;
+
+    memset(&b, 0, sizeof(b));
+    b.frame_size = frame_size;
+    b.frames = frames;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    b.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int out = socket(AF_INET, SOCK_DGRAM, 0);
+    if (b.fd < 0 || out < 0 || bind(b.fd, (struct sockaddr *) &sa, sizeof(sa))
+        || getsockname(b.fd, (struct sockaddr *) &sa, &len)) {
+        perror("udp socket");
+        exit(1);
+    }
+    setsockopt(b.fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(b.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    unsigned char *frame = malloc(frame_size);
+    memset(frame, 'x', frame_size);
+
+    double start = now();
+    pthread_create(&tid, NULL, udp_consumer, &b);
+    for (uint64_t i = 0; i < frames; i++)
+        sendto(out, frame, frame_size, 0, (struct sockaddr *) &sa, sizeof(sa));
+    double sent = now();
+    b.done = 1;
+    pthread_join(tid, NULL);
+
+    printf("%6u %-4s %10llu sent %10llu received %8.1f ns/send\n",
+           frame_size, "udp", (unsigned long long) frames, (unsigned long long) b.received,
+           (sent - start) * 1e9 / frames);
+
+    free(frame);
+    close(out);
+    close(b.fd);
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t frame_sizes[] = { 16, 256, 4096 };
+    uint64_t frames = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+        bench_shm(frame_sizes[i], frames);
+        bench_udp(frame_sizes[i], frames);
+    }
+
+    return 0;
+}
@@ -0,0 +1,194 @@
+/* Microbenchmark of the tcp framing.
+ *
+ * Compares the old framing, which moved the rest of the buffer to the
+ * front after every frame, with tcp_consume_frames() of src/ingest.c,
+ * which frames from a read cursor and compacts at most once per read.
+ * The socket is simulated with a memcpy() from a prebuilt stream, so that
+ * only the framing and the blobs it makes are measured.
+ *
+ * Build with "make bench", run as bin/bench_tcp_framing [megabytes]. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/ingest.h"
+
+/* The old per-client buffer. */
+#define ASYNC_BUFFER_SIZE (MAX_CHUNK_SIZE + EXPECTED_HEADER_SIZE)
+
+struct stream {
+    unsigned char *data;
+    size_t size;
+    size_t pos;
+};
+
+struct result {
+    uint64_t frames;
+    uint64_t reads;
+    uint64_t sink;
+};
+
+/* Stands in for the recv(): hands out as much as asked for. */
+static size_t stream_read(struct stream *s, unsigned char *dst, size_t len)
+{
+    size_t left = s->size - s->pos;
+    if (len > left)
+        len = left;
+    memcpy(dst, s->data + s->pos, len);
+    s->pos += len;
+    return len;
+}
+
+/* Stands in for enqueue_blobs_for_transmission(), touching both ends
+ * of every frame before releasing it. */
+static void drain(struct result *r, queue_t * batch)
+{
+    blob_t *b;
+    while ((b = queue_shift_nolock(batch))) {
+        unsigned char *buf = (unsigned char *) BLOB_BUF_addr(b);
+        r->frames++;
+        r->sink += buf[0] + buf[BLOB_BUF_SIZE(b) - 1];
+        blob_destroy(b);
+    }
+}
+
+static void frame_memmove_per_frame(struct stream *s, struct result *r)
+{
+    unsigned char *buf = malloc(ASYNC_BUFFER_SIZE);
+    stats_basic_counters_t counters;
+    queue_t batch;
+    uint32_t pos = 0;
+
+    memset(&counters, 0, sizeof(counters));
+    memset(&batch, 0, sizeof(batch));
+
+    for (;;) {
+        size_t received = stream_read(s, buf + pos, ASYNC_BUFFER_SIZE - pos);
+        if (received == 0)
+            break;
+        r->reads++;
+        pos += received;
+
+        while (pos >= EXPECTED_HEADER_SIZE) {
+            uint32_t size = EXPECTED_PACKET_SIZE(buf);
+            if (pos < size + EXPECTED_HEADER_SIZE)
+                break;
+            buf_to_blob_enqueue(&counters, &batch, buf + EXPECTED_HEADER_SIZE, size);
+            pos -= size + EXPECTED_HEADER_SIZE;
+            if (pos > 0)
+                memmove(buf, buf + EXPECTED_HEADER_SIZE + size, pos);
+        }
+        drain(r, &batch);
+    }
+
+    free(buf);
+}
+
+/* The read loop of tcp_read() in relay.c, without the socket. */
+static void frame_read_cursor(struct stream *s, struct result *r)
+{
+    stats_basic_counters_t counters;
+    tcp_server_context_t ctxt;
+    struct tcp_client client;
+
+    memset(&counters, 0, sizeof(counters));
+    memset(&ctxt, 0, sizeof(ctxt));
+    memset(&client, 0, sizeof(client));
+    ctxt.counters = &counters;
+
+    for (;;) {
+        size_t received;
+        if (client.frame) {
+            received = stream_read(s, (unsigned char *) BLOB_BUF_addr(client.frame) + client.frame_pos,
+                                   BLOB_BUF_SIZE(client.frame) - client.frame_pos);
+            if (received == 0)
+                break;
+            r->reads++;
+            client.frame_pos += received;
+            if (client.frame_pos == BLOB_BUF_SIZE(client.frame)) {
+                reserved_blob_enqueue(&counters, &ctxt.batch, client.frame, client.frame_pos);
+                client.frame = NULL;
+                client.frame_pos = 0;
+            }
+        } else {
+            if (!client.buf)
+                tcp_buffer_get(&ctxt, &client, TCP_BUFFER_SMALL);
+            received = stream_read(s, client.buf + client.pos, tcp_buffer_sizes[client.buf_class] - client.pos);
+            if (received == 0)
+                break;
+            r->reads++;
+            client.pos += received;
+            if (!tcp_consume_frames(&ctxt, &client)) {
+                fprintf(stderr, "Framing failed\n");
+                exit(1);
+            }
+        }
+        drain(r, &ctxt.batch);
+    }
+
+    if (client.frame)
+        blob_release_reserved(client.frame);
+    if (client.buf)
+        tcp_buffer_put(&ctxt, &client);
+    tcp_buffer_pool_close(&ctxt);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(const char *name, void (*framer) (struct stream *, struct result *), struct stream *s,
+                uint32_t frame_size)
+{
+    struct result r;
+    memset(&r, 0, sizeof(r));
+    s->pos = 0;
+
+    double start = now();
+    framer(s, &r);
+    double elapsed = now() - start;
+
+    printf("%6u %-10s %10llu frames %8.1f ns/frame %10.1f MB/s %6.2f frames/read (%llu)\n",
+           frame_size, name, (unsigned long long) r.frames, elapsed * 1e9 / r.frames, s->size / elapsed / 1e6,
+           (double) r.frames / r.reads, (unsigned long long) r.sink);
+}
+
+int main(int argc, char **argv)
+{
+    static const uint32_t frame_sizes[] = { 16, 256, 4096, 16384 };
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+
+    for (size_t i = 0; i < sizeof(frame_sizes) / sizeof(frame_sizes[0]); i++) {
+        uint32_t frame_size = frame_sizes[i];
+        size_t n_frames = (megabytes << 20) / (EXPECTED_HEADER_SIZE + frame_size);
+        struct stream s;
+
+        s.size = n_frames * (EXPECTED_HEADER_SIZE + frame_size);
+        s.data = malloc(s.size);
+        if (!s.data) {
+            fprintf(stderr, "Unable to allocate %zu bytes\n", s.size);
+            return 1;
+        }
+        for (size_t j = 0; j < n_frames; j++) {
+            unsigned char *p = s.data + j * (EXPECTED_HEADER_SIZE + frame_size);
+            p[0] = frame_size & 0xFF;
+            p[1] = (frame_size >> 8) & 0xFF;
+            p[2] = (frame_size >> 16) & 0xFF;
+            p[3] = (frame_size >> 24) & 0xFF;
+            memset(p + EXPECTED_HEADER_SIZE, (int) (j & 0xFF), frame_size);
+        }
+
+        run("memmove", frame_memmove_per_frame, &s, frame_size);
+        run("cursor", frame_read_cursor, &s, frame_size);
+
+        free(s.data);
+    }
+
+    return 0;
+}